@@ -31,16 +31,21 @@
 #ifdef USE_GL /* whole file */
 
 #define DEF_SPEED       "1.0"
+#define DEF_MATCAP      "False"
 
 
 static float speed;
+static Bool do_matcap;
 
 static XrmOptionDescRec opts[] = {
   { "-speed",  ".speed",  XrmoptionSepArg, 0 },
+  { "-matcap", ".matcap", XrmoptionNoArg, "True" },
+  { "-no-matcap", ".matcap", XrmoptionNoArg, "False" },
 };
 
 static argtype vars[] = {
   {&speed,     "speed",  "Speed",  DEF_SPEED,  t_Float},
+  {&do_matcap, "matcap", "Matcap", DEF_MATCAP, t_Bool},
 };
 
 ENTRYPOINT ModeSpecOpt accsph_opts =
@@ -55,6 +60,13 @@ ENTRYPOINT ModeSpecOpt accsph_opts =
 /* just the initial size, the buffer increases as needed */
 #define INIT_NUM_SPHERES 40
 
+/* size of the lighting lookup texture (matcap) */
+#define MATCAP_SIZE 64
+
+/* the lookup is rebuilt when the light has moved by more than
+   this angle (cosine of about 2 degrees) */
+#define MATCAP_REGEN_COS 0.9994
+
 
 struct generator {
   float rgb[3];
@@ -74,6 +86,23 @@ struct sphere {
   int alive;
 };
 
+/* sphere mesh for the matcap mode, the texture coordinates are the
+   view space normals, which is right since the spheres are only
+   translated and scaled */
+struct matcap_mesh {
+  float *verts;
+  float *tex_coords;
+  unsigned short *indices;
+  int num_indices;
+};
+
+struct matcap {
+  GLuint tex_id;
+  float light_dir[3];
+  int valid;
+  struct matcap_mesh meshes[2];
+};
+
 struct app {
   float angle;
   double ratio;
@@ -83,6 +112,7 @@ struct app {
   gln_mesh *meshes[2];
   gln_matrices matrices;
   gln_drawMeshParams p;
+  struct matcap matcap;
   unsigned int num_spheres;
   struct sphere *spheres;
   GLXContext *glx_context;
@@ -221,10 +251,196 @@ static void init_spheres(struct app *app)
 }
 
 
+static void normalize(float *xyz)
+{
+  double x = xyz[0];
+  double y = xyz[1];
+  double z = xyz[2];
+  double len = sqrt(x * x + y * y + z * z);
+  xyz[0] = x / len;
+  xyz[1] = y / len;
+  xyz[2] = z / len;
+}
+
+
+/* {{{ matcap lighting */
+
+static void
+make_matcap_mesh(struct matcap_mesh *mesh, float radius, int slices, int stacks)
+{
+  int i, j, n;
+  int num_verts = (slices + 1) * (stacks + 1);
+
+  mesh->num_indices = slices * stacks * 6;
+  mesh->verts = malloc(num_verts * 3 * sizeof(float));
+  mesh->tex_coords = malloc(num_verts * 2 * sizeof(float));
+  mesh->indices = malloc(mesh->num_indices * sizeof(unsigned short));
+  if (!mesh->verts || !mesh->tex_coords || !mesh->indices) {
+    fprintf(stderr, "%s: out of memory\n", progname);
+    exit(1);
+  }
+
+  n = 0;
+  for (i = 0; i <= stacks; i++)
+  {
+    double theta = M_PI * i / stacks;
+    for (j = 0; j <= slices; j++)
+    {
+      double phi = 2.0 * M_PI * j / slices;
+      float nx = sin(theta) * cos(phi);
+      float ny = cos(theta);
+      float nz = -sin(theta) * sin(phi);
+      mesh->verts[n * 3 + 0] = radius * nx;
+      mesh->verts[n * 3 + 1] = radius * ny;
+      mesh->verts[n * 3 + 2] = radius * nz;
+      mesh->tex_coords[n * 2 + 0] = nx * 0.5 + 0.5;
+      mesh->tex_coords[n * 2 + 1] = ny * 0.5 + 0.5;
+      n++;
+    }
+  }
+
+  n = 0;
+  for (i = 0; i < stacks; i++)
+    for (j = 0; j < slices; j++)
+    {
+      unsigned short a = i * (slices + 1) + j;
+      unsigned short b = a + (slices + 1);
+      mesh->indices[n++] = a;
+      mesh->indices[n++] = b;
+      mesh->indices[n++] = b + 1;
+      mesh->indices[n++] = a;
+      mesh->indices[n++] = b + 1;
+      mesh->indices[n++] = a + 1;
+    }
+}
+
+static void delete_matcap_mesh(struct matcap_mesh *mesh)
+{
+  free(mesh->verts);
+  free(mesh->tex_coords);
+  free(mesh->indices);
+}
+
+/* bakes ambient + diffuse + specular for the current light direction,
+   indexed by the xy of the view space normal */
+static void build_matcap(struct matcap *mc, const float *light_dir)
+{
+  static unsigned char texels[MATCAP_SIZE * MATCAP_SIZE];
+  float half[3];
+  int u, v;
+
+  half[0] = light_dir[0];
+  half[1] = light_dir[1];
+  half[2] = light_dir[2] + 1.0;
+  normalize(half);
+
+  for (v = 0; v < MATCAP_SIZE; v++)
+    for (u = 0; u < MATCAP_SIZE; u++)
+    {
+      float nx = (u + 0.5) * 2.0 / MATCAP_SIZE - 1.0;
+      float ny = (v + 0.5) * 2.0 / MATCAP_SIZE - 1.0;
+      float nz2 = 1.0 - nx * nx - ny * ny;
+      float nz = (nz2 > 0.0 ? sqrt(nz2) : 0.0);
+      float diff = nx * light_dir[0] + ny * light_dir[1] + nz * light_dir[2];
+      float spec = nx * half[0] + ny * half[1] + nz * half[2];
+      float c;
+      if (diff < 0.0) diff = 0.0;
+      if (spec < 0.0) spec = 0.0;
+      c = 0.2 + 0.8 * diff + 0.3 * pow(spec, 32.0);
+      if (c > 1.0) c = 1.0;
+      texels[v * MATCAP_SIZE + u] = (unsigned char) (c * 255.0);
+    }
+
+  glBindTexture(GL_TEXTURE_2D, mc->tex_id);
+  if (mc->valid)
+    glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, MATCAP_SIZE, MATCAP_SIZE,
+                    GL_LUMINANCE, GL_UNSIGNED_BYTE, texels);
+  else
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_LUMINANCE, MATCAP_SIZE, MATCAP_SIZE, 0,
+                 GL_LUMINANCE, GL_UNSIGNED_BYTE, texels);
+
+  memcpy(mc->light_dir, light_dir, 3 * sizeof(float));
+  mc->valid = 1;
+}
+
+static void init_matcap(struct matcap *mc)
+{
+  make_matcap_mesh(&mc->meshes[0], 0.2, 32, 16);
+  make_matcap_mesh(&mc->meshes[1], 0.2, 64, 32);
+
+  glGenTextures(1, &mc->tex_id);
+  glBindTexture(GL_TEXTURE_2D, mc->tex_id);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+  glTexEnvi(GL_TEXTURE_ENV, GL_TEXTURE_ENV_MODE, GL_MODULATE);
+  mc->valid = 0;
+}
+
+static void delete_matcap(struct matcap *mc)
+{
+  delete_matcap_mesh(&mc->meshes[0]);
+  delete_matcap_mesh(&mc->meshes[1]);
+  glDeleteTextures(1, &mc->tex_id);
+}
+
+/* the light only turns slowly, so the lookup is kept
+   until it has moved noticeably */
+static void update_matcap(struct matcap *mc, const float *light_dir)
+{
+  if (mc->valid) {
+    float d = mc->light_dir[0] * light_dir[0] +
+              mc->light_dir[1] * light_dir[1] +
+              mc->light_dir[2] * light_dir[2];
+    if (d > MATCAP_REGEN_COS) return;
+  }
+  build_matcap(mc, light_dir);
+}
+
+static void matcap_begin(struct matcap *mc)
+{
+  glEnable(GL_TEXTURE_2D);
+  glBindTexture(GL_TEXTURE_2D, mc->tex_id);
+  glEnableClientState(GL_VERTEX_ARRAY);
+  glEnableClientState(GL_TEXTURE_COORD_ARRAY);
+}
+
+static void matcap_end(void)
+{
+  glDisableClientState(GL_TEXTURE_COORD_ARRAY);
+  glDisableClientState(GL_VERTEX_ARRAY);
+  glDisable(GL_TEXTURE_2D);
+}
+
+static void draw_matcap_item(struct matcap *mc, gln_matrices *m,
+                             float *pos, float *color, float s)
+{
+  struct matcap_mesh *mesh;
+  if (s < 0.7) mesh = &mc->meshes[0]; else mesh = &mc->meshes[1];
+
+  glMatrixMode(GL_PROJECTION);
+  glLoadMatrixf(m->projection);
+  glMatrixMode(GL_MODELVIEW);
+  glLoadIdentity();
+  glTranslatef(pos[0], pos[1], pos[2]);
+  glScalef(s, s, s);
+
+  glColor3fv(color);
+  glVertexPointer(3, GL_FLOAT, 0, mesh->verts);
+  glTexCoordPointer(2, GL_FLOAT, 0, mesh->tex_coords);
+  glDrawElements(GL_TRIANGLES, mesh->num_indices,
+                 GL_UNSIGNED_SHORT, mesh->indices);
+}
+
+/* }}} */
+
+
 static void init_app_content(struct app *app)
 {
   app->meshes[0] = glnMakeSphere(0.2, 32, 16, GLN_GEN_NORMALS);
   app->meshes[1] = glnMakeSphere(0.2, 64, 32, GLN_GEN_NORMALS);
+  init_matcap(&app->matcap);
 
   make_generators(app);
   init_spheres(app);
@@ -301,6 +517,7 @@ static void delete_app(struct app *app)
 {
   glnDeleteMesh(app->meshes[0]);
   glnDeleteMesh(app->meshes[1]);
+  delete_matcap(&app->matcap);
 
   free(app->spheres);
   free(app->gens);
@@ -335,17 +552,6 @@ static inline void vec_add(float *v1, const float *v2)
   v1[2] += v2[2];
 }
 
-static void normalize(float *xyz)
-{
-  double x = xyz[0];
-  double y = xyz[1];
-  double z = xyz[2];
-  double len = sqrt(x * x + y * y + z * z);
-  xyz[0] = x / len;
-  xyz[1] = y / len;
-  xyz[2] = z / len;
-}
-
 
 static void init_sphere(struct sphere *s, float *rgb, float *xyz, float size)
 {
@@ -437,6 +643,10 @@ static void draw_item(
     struct app *app, gln_matrices *m, float *pos, float *color, float s)
 {
   gln_mesh *mesh;
+  if (do_matcap) {
+    draw_matcap_item(&app->matcap, m, pos, color, s);
+    return;
+  }
   glnLoadIdentity(m);
   glnTranslate(m, pos[0], pos[1], pos[2]);
   glnScale(m, s, s, s);
@@ -528,6 +738,9 @@ static void display(struct app *app)
     normalize(app->p.light_dir);
   }
 
+  if (do_matcap)
+    update_matcap(&app->matcap, app->p.light_dir);
+
   for (i = 0; i < app->n_gens; i++)
   {
     if (dt > frand(2.0))
@@ -539,8 +752,12 @@ static void display(struct app *app)
   filter_spheres(app);
   check_spheres(app);
 
+  if (do_matcap) matcap_begin(&app->matcap);
+
   draw_spheres(app, dt);
   draw_gens(app, dt);
+
+  if (do_matcap) matcap_end();
 }
 
 
@@ -596,6 +813,9 @@ accsph_handle_event (ModeInfo *mi, XEvent *ev)
       case 'd':
         speed *= 0.8;
         return True;
+      case 'l':
+        do_matcap = !do_matcap;
+        return True;
     }
   }
   return False;
@@ -16,6 +16,9 @@
  * other special, indirect and consequential damages.
  */
 
+/* for the buffer objects and shaders entry points */
+#define GL_GLEXT_PROTOTYPES
+
 #ifdef STANDALONE
   #define DEFAULTS \
        "*delay:      60000 \n" \
@@ -30,22 +33,58 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdint.h>
 #include <math.h>
 #include <setjmp.h>
 #include <jpeglib.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/time.h>
+#include <fcntl.h>
 #include <unistd.h>
+#ifdef HAVE_PTHREAD
+# include <pthread.h>
+#endif
+#ifdef __SSE2__
+# include <emmintrin.h>
+#endif
 
 /*#include "leaf_moon.h"*/
 
 #ifdef USE_GL
 
 
-ENTRYPOINT ModeSpecOpt leaf_moon_opts = {
-  0, NULL, 0, NULL, NULL
+#undef countof
+#define countof(x) (sizeof((x))/sizeof((*x)))
+
+#define DEF_CUBES    "1"
+#define DEF_SHADERS  "True"
+#define DEF_STATS    "False"
+
+static int num_cubes;
+static Bool use_shaders;
+static Bool show_stats;
+
+static XrmOptionDescRec opts[] = {
+  { "-cubes",      ".cubes",    XrmoptionSepArg, 0 },
+  { "-shaders",    ".shaders",  XrmoptionNoArg, "True" },
+  { "-no-shaders", ".shaders",  XrmoptionNoArg, "False" },
+  { "-stats",      ".stats",    XrmoptionNoArg, "True" },
+  { "-no-stats",   ".stats",    XrmoptionNoArg, "False" },
+};
+
+static argtype vars[] = {
+  {&num_cubes,   "cubes",   "Cubes",   DEF_CUBES,   t_Int},
+  {&use_shaders, "shaders", "Shaders", DEF_SHADERS, t_Bool},
+  {&show_stats,  "stats",   "Stats",   DEF_STATS,   t_Bool},
 };
 
+ENTRYPOINT ModeSpecOpt leaf_moon_opts =
+  {countof(opts), opts, countof(vars), vars, NULL};
+
 #ifdef USE_MODULES
 ModStruct  leaf_moon_description =
   { "leaf_moon",
@@ -88,10 +127,128 @@ struct tex_container {
   unsigned int height;
   unsigned int num_components;
   unsigned int color_space;
+  /* the mipmaps follow the image in tex_data */
+  int num_levels;
+  /* of the image decoded, from the size in the file */
+  int scale_denom;
+  /* set when tex_data points into a mapped cache file */
+  void * cache_map;
+  size_t cache_size;
 };
 
+static double get_time(void)
+{
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec + tv.tv_usec * 1e-6;
+}
+
 /* {{{ JPEG */
 
+/* the whole file in memory, mapped when it can be */
+struct file_data {
+  unsigned char *data;
+  size_t size;
+  int mapped;
+};
+
+static int read_whole_file(const char *filename, struct file_data *file)
+{
+  struct stat st;
+  int fd;
+
+  if ((fd = open(filename, O_RDONLY)) < 0)
+    return 0;
+  if (fstat(fd, &st) != 0 || st.st_size <= 0) {
+    close(fd);
+    return 0;
+  }
+  file->size = st.st_size;
+
+  file->data = mmap(NULL, file->size, PROT_READ, MAP_PRIVATE, fd, 0);
+  file->mapped = (file->data != MAP_FAILED);
+  if (file->mapped) {
+    /* read once, from the start to the end */
+    madvise(file->data, file->size, MADV_SEQUENTIAL);
+  }
+  else
+  {
+    /* some file systems can not be mapped */
+    size_t got = 0;
+    ssize_t n = 0;
+    file->data = malloc(file->size);
+    if (file->data == NULL) {
+      close(fd);
+      return 0;
+    }
+    while (got < file->size &&
+           (n = read(fd, file->data + got, file->size - got)) > 0)
+      got += n;
+    if (got != file->size) {
+      free(file->data);
+      close(fd);
+      return 0;
+    }
+  }
+  close(fd);
+  return 1;
+}
+
+static void release_file(struct file_data *file)
+{
+  if (file->mapped)
+    munmap(file->data, file->size);
+  else
+    free(file->data);
+  file->data = NULL;
+}
+
+#if JPEG_LIB_VERSION < 80 && !defined(MEM_SRCDST_SUPPORTED)
+/* libjpeg 6b has no jpeg_mem_src(), the same over the buffer */
+static void mem_init_source(j_decompress_ptr cinfo) { }
+static void mem_term_source(j_decompress_ptr cinfo) { }
+
+static boolean mem_fill_input_buffer(j_decompress_ptr cinfo)
+{
+  /* truncated file, end it as libjpeg does */
+  static const JOCTET eoi[2] = { 0xFF, JPEG_EOI };
+  cinfo->src->next_input_byte = eoi;
+  cinfo->src->bytes_in_buffer = 2;
+  return TRUE;
+}
+
+static void mem_skip_input_data(j_decompress_ptr cinfo, long num_bytes)
+{
+  struct jpeg_source_mgr *src = cinfo->src;
+  if (num_bytes <= 0)
+    return;
+  if ((size_t) num_bytes > src->bytes_in_buffer) {
+    mem_fill_input_buffer(cinfo);
+    return;
+  }
+  src->next_input_byte += num_bytes;
+  src->bytes_in_buffer -= num_bytes;
+}
+
+static void jpeg_mem_src(j_decompress_ptr cinfo,
+                         unsigned char *buffer, unsigned long size)
+{
+  struct jpeg_source_mgr *src;
+  if (cinfo->src == NULL)
+    cinfo->src = (struct jpeg_source_mgr *)
+      (*cinfo->mem->alloc_small) ((j_common_ptr) cinfo, JPOOL_PERMANENT,
+                                  sizeof(struct jpeg_source_mgr));
+  src = cinfo->src;
+  src->init_source = mem_init_source;
+  src->fill_input_buffer = mem_fill_input_buffer;
+  src->skip_input_data = mem_skip_input_data;
+  src->resync_to_restart = jpeg_resync_to_restart;
+  src->term_source = mem_term_source;
+  src->next_input_byte = buffer;
+  src->bytes_in_buffer = size;
+}
+#endif
+
 struct my_error_mgr {
   struct jpeg_error_mgr pub;    /* "public" fields */
   jmp_buf setjmp_buffer;        /* for return to caller */
@@ -108,18 +265,19 @@ my_error_exit (j_common_ptr cinfo)
   longjmp(myerr->setjmp_buffer, 1);
 }
 
-/* JPEG decompression */
+/* JPEG decompression, the file is mapped and decoded from memory,
+   scaled down by 1/scale_denom (1, 2, 4 or 8) in the DCT */
 static void
-load_jpeg_file (char * filename, struct tex_container * cont)
+load_jpeg_file (char * filename, int scale_denom,
+                struct tex_container * cont)
 {
   struct jpeg_decompress_struct cinfo;
   struct my_error_mgr jerr;
   char err_buf[192];
-  FILE * infile;
-  unsigned char * image;
+  struct file_data file;
   unsigned char * img_data;
 
-  if ((infile = fopen(filename, "rb")) == NULL) {
+  if (!read_whole_file(filename, &file)) {
     snprintf(err_buf, 192, "Error: can't open jpeg file '%s'", filename);
     /* TODO make an xscreensaver compatible error handling */
     fprintf(stderr, "%s", err_buf);
@@ -132,44 +290,116 @@ load_jpeg_file (char * filename, struct tex_container * cont)
   if (setjmp(jerr.setjmp_buffer)) {
     snprintf(err_buf, 192, "Error while loading jpeg file '%s'", filename);
     jpeg_destroy_decompress(&cinfo);
-    fclose(infile);
+    release_file(&file);
     /* TODO make an xscreensaver compatible error handling */
     fprintf(stderr, "%s", err_buf);
     exit(1);
   }
 
   jpeg_create_decompress(&cinfo);
-  jpeg_stdio_src(&cinfo, infile);
+  jpeg_mem_src(&cinfo, file.data, file.size);
 
   (void) jpeg_read_header(&cinfo, TRUE);
 
+  cinfo.scale_num = 1;
+  cinfo.scale_denom = scale_denom;
+
   (void) jpeg_start_decompress(&cinfo);
   {
-    unsigned char *line;
-    img_data = (unsigned char *)malloc(sizeof(char) *
-                                       cinfo.output_width *
-                                       cinfo.output_height *
-                                       cinfo.output_components);
-    image = img_data;
-    line = image;
+    /* the decoder gives up to rec_outbuf_height lines per call,
+       they go straight into the image */
+    size_t stride = cinfo.output_width * cinfo.output_components;
+    int batch = cinfo.rec_outbuf_height;
+    JSAMPARRAY rows;
+    int i;
+
+    img_data = (unsigned char *)malloc(stride * cinfo.output_height);
+    if (img_data == NULL) {
+      fprintf(stderr, "out of memory\n");
+      exit(1);
+    }
+    rows = (*cinfo.mem->alloc_small) ((j_common_ptr) &cinfo, JPOOL_IMAGE,
+                                      batch * sizeof(JSAMPROW));
 
     while (cinfo.output_scanline < cinfo.output_height) {
-      line = image + cinfo.output_components * cinfo.output_width * cinfo.output_scanline;
-      (void) jpeg_read_scanlines(&cinfo, &line, 1);
+      for (i = 0; i < batch; i++) {
+        JDIMENSION line = cinfo.output_scanline + i;
+        if (line >= cinfo.output_height)
+          line = cinfo.output_height - 1;
+        rows[i] = img_data + stride * line;
+      }
+      (void) jpeg_read_scanlines(&cinfo, rows, batch);
     }
   }
 
   (void) jpeg_finish_decompress(&cinfo);
 
-  fclose(infile);
+  release_file(&file);
 
   cont->tex_data       = img_data;
   cont->width          = cinfo.output_width;
   cont->height         = cinfo.output_height;
   cont->num_components = cinfo.output_components;
   cont->color_space    = cinfo.out_color_space;
+  cont->num_levels     = 1;
+  cont->scale_denom    = scale_denom;
+
+  jpeg_destroy_decompress(&cinfo);
+}
+
+/* reads only the header, for the size of the image */
+static int
+jpeg_image_size (char * filename, unsigned int * width, unsigned int * height)
+{
+  struct jpeg_decompress_struct cinfo;
+  struct my_error_mgr jerr;
+  struct file_data file;
+
+  if (!read_whole_file(filename, &file))
+    return 0;
+
+  cinfo.err = jpeg_std_error(&jerr.pub);
+  jerr.pub.error_exit = my_error_exit;
+
+  if (setjmp(jerr.setjmp_buffer)) {
+    jpeg_destroy_decompress(&cinfo);
+    release_file(&file);
+    return 0;
+  }
+
+  jpeg_create_decompress(&cinfo);
+  jpeg_mem_src(&cinfo, file.data, file.size);
+  (void) jpeg_read_header(&cinfo, TRUE);
+  *width  = cinfo.image_width;
+  *height = cinfo.image_height;
 
   jpeg_destroy_decompress(&cinfo);
+  release_file(&file);
+  return 1;
+}
+
+/* The faces show 0.35 of the texture (a quarter of it, scaled by the
+   texture matrix), and a face is at most 0.62 of the view height, so
+   no more than 1.8 texels for each pixel of the height are seen. */
+#define TEXELS_PER_VIEW_HEIGHT 1.8
+
+/* the biggest reduction which keeps enough texels for the view, and
+   the texture within what GL takes */
+static int choose_scale_denom(unsigned int width, unsigned int height,
+                              int view_height, int max_size)
+{
+  unsigned int size = (width > height) ? width : height;
+  unsigned int needed = ceil(view_height * TEXELS_PER_VIEW_HEIGHT);
+  int denom = 1;
+
+  if (view_height <= 0)
+    return 1;
+  /* libjpeg rounds the scaled size up */
+  while (denom < 8 && (size + 2 * denom - 1) / (2 * denom) >= needed)
+    denom *= 2;
+  while (denom < 8 && max_size > 0 && (size + denom - 1) / denom > max_size)
+    denom *= 2;
+  return denom;
 }
 
 /* }}} */
@@ -180,65 +410,568 @@ static int file_exists(const char *name)
   return (stat(name, &st) == 0);
 }
 
-static GLuint init_texture (void)
+/* {{{ mipmaps */
+
+/* the bytes of the levels from 0 to num_levels - 1 */
+static size_t tex_levels_size(unsigned int width, unsigned int height,
+                              unsigned int num_components, int num_levels)
 {
-  struct tex_container cont;
+  size_t size = 0;
+  int l;
+  for (l = 0; l < num_levels; l++) {
+    size += (size_t) width * height * num_components;
+    if (width > 1) width /= 2;
+    if (height > 1) height /= 2;
+  }
+  return size;
+}
+
+/* the levels down to 1x1 */
+static int tex_num_levels(unsigned int width, unsigned int height)
+{
+  int n = 1;
+  while (width > 1 || height > 1) {
+    width /= 2;
+    height /= 2;
+    n++;
+  }
+  return n;
+}
+
+/* a level from the one above it, each texel is the average of 2x2
+   texels (an odd last row or column is left out) */
+static void downsample_level(const unsigned char *src,
+                             unsigned int sw, unsigned int sh,
+                             unsigned char *dst,
+                             unsigned int dw, unsigned int dh,
+                             int num_components)
+{
+  size_t src_stride = (size_t) sw * num_components;
+  int c = num_components;
+  /* from a texel to the other one of its pair */
+  int dx = (sw > 1) ? c : 0;
+  unsigned int x, y;
+  int k;
+
+  for (y = 0; y < dh; y++) {
+    const unsigned char *a = src + src_stride * (sh > 1 ? 2 * y : y);
+    const unsigned char *b = (sh > 1) ? a + src_stride : a;
+    unsigned char *d = dst + (size_t) dw * c * y;
+
+    x = 0;
+#ifdef __SSE2__
+    /* gray: the 16 bit lanes hold a pair of texels each */
+    if (c == 1 && sw > 1) {
+      __m128i low = _mm_set1_epi16(0xff);
+      __m128i two = _mm_set1_epi16(2);
+      for (; x + 8 <= dw; x += 8) {
+        __m128i ra = _mm_loadu_si128((const __m128i *) (a + 2 * x));
+        __m128i rb = _mm_loadu_si128((const __m128i *) (b + 2 * x));
+        __m128i sum;
+        sum = _mm_add_epi16(
+                _mm_add_epi16(_mm_and_si128(ra, low), _mm_srli_epi16(ra, 8)),
+                _mm_add_epi16(_mm_and_si128(rb, low), _mm_srli_epi16(rb, 8)));
+        sum = _mm_srli_epi16(_mm_add_epi16(sum, two), 2);
+        _mm_storel_epi64((__m128i *) (d + x), _mm_packus_epi16(sum, sum));
+      }
+    }
+#endif
+    for (; x < dw; x++) {
+      const unsigned char *pa = a + 2 * x * c;
+      const unsigned char *pb = b + 2 * x * c;
+      for (k = 0; k < c; k++)
+        d[x * c + k] = (pa[k] + pa[k + dx] + pb[k] + pb[k + dx] + 2) >> 2;
+    }
+  }
+}
+
+/* appends the whole chain of levels to the image */
+static void build_mipmaps(struct tex_container *cont)
+{
+  unsigned int w = cont->width, h = cont->height;
+  int n = tex_num_levels(w, h);
+  unsigned char *level;
+  int l;
+
+  cont->tex_data = realloc(cont->tex_data,
+                           tex_levels_size(w, h, cont->num_components, n));
+  if (cont->tex_data == NULL) {
+    fprintf(stderr, "out of memory\n");
+    exit(1);
+  }
+
+  level = cont->tex_data;
+  for (l = 1; l < n; l++) {
+    unsigned int nw = (w > 1) ? w / 2 : 1;
+    unsigned int nh = (h > 1) ? h / 2 : 1;
+    unsigned char *next = level + (size_t) w * h * cont->num_components;
+    downsample_level(level, w, h, next, nw, nh, cont->num_components);
+    level = next;
+    w = nw;
+    h = nh;
+  }
+  cont->num_levels = n;
+}
+
+/* }}} */
+
+/* {{{ texture cache */
+
+/* The decoded pixels are kept in ~/.cache/xscreensaver (or under
+   $XDG_CACHE_HOME), one file per source image and scale, so at most
+   four of them. The file is a header, then the pixels from
+   CACHE_DATA_OFFSET, so they can be mapped and given to glTexImage2D
+   as they are. The processes showing the hack at the same time share
+   the pages of the file.
+
+   The header holds the path, size and mtime of the source, a file
+   which does not match them is decoded again and replaced. */
+
+#define CACHE_MAGIC       "LMTEX02"
+#define CACHE_PATH_MAX    1024
+#define CACHE_DATA_OFFSET 4096
+
+struct cache_header {
+  char magic[8];
+  char src_path[CACHE_PATH_MAX];
+  uint64_t src_size;
+  int64_t src_mtime;
+  uint32_t width;
+  uint32_t height;
+  uint32_t num_components;
+  uint32_t color_space;
+  /* the levels follow each other, from the biggest one */
+  uint32_t num_levels;
+  uint32_t scale_denom;
+  uint32_t data_offset;
+};
+
+/* the name of the cache file of the image at a scale, and the key of
+   the image: its absolute path and stat() */
+static int cache_file_name(const char *img_path, int scale_denom,
+                           char *cache_path, size_t len,
+                           char *src_path, struct stat *st)
+{
+  const char *dir;
+  const unsigned char *c;
+  uint32_t hash = 2166136261u;
+
+  if (realpath(img_path, src_path) == NULL ||
+      strlen(src_path) >= CACHE_PATH_MAX ||
+      stat(src_path, st) != 0)
+    return 0;
+
+  /* FNV-1a of the path */
+  for (c = (const unsigned char *) src_path; *c; c++)
+    hash = (hash ^ *c) * 16777619u;
+
+  if ((dir = getenv("XDG_CACHE_HOME")) != NULL && *dir)
+    return snprintf(cache_path, len, "%s/xscreensaver/leafmoon-%08x-%d.tex",
+                    dir, hash, scale_denom) < len;
+  if ((dir = getenv("HOME")) != NULL && *dir)
+    return snprintf(cache_path, len,
+                    "%s/.cache/xscreensaver/leafmoon-%08x-%d.tex",
+                    dir, hash, scale_denom) < len;
+  return 0;
+}
+
+static int cache_matches(const struct cache_header *h, size_t file_size,
+                         const char *src_path, const struct stat *st,
+                         int scale_denom)
+{
+  return (memcmp(h->magic, CACHE_MAGIC, sizeof(h->magic)) == 0 &&
+          h->scale_denom == scale_denom &&
+          strncmp(h->src_path, src_path, CACHE_PATH_MAX) == 0 &&
+          h->src_size == (uint64_t) st->st_size &&
+          h->src_mtime == (int64_t) st->st_mtime &&
+          h->data_offset == CACHE_DATA_OFFSET &&
+          h->num_levels == tex_num_levels(h->width, h->height) &&
+          file_size == CACHE_DATA_OFFSET +
+                       tex_levels_size(h->width, h->height,
+                                       h->num_components, h->num_levels));
+}
+
+/* maps the cache file, the pixels stay in the mapping */
+static int load_cached_texture(const char *cache_path, const char *src_path,
+                               const struct stat *st, int scale_denom,
+                               struct tex_container *cont)
+{
+  const struct cache_header *h;
+  struct stat cst;
+  void *map;
+  int fd;
+
+  if ((fd = open(cache_path, O_RDONLY)) < 0)
+    return 0;
+  if (fstat(fd, &cst) != 0 || cst.st_size < CACHE_DATA_OFFSET) {
+    close(fd);
+    return 0;
+  }
+  map = mmap(NULL, cst.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED)
+    return 0;
+
+  h = (const struct cache_header *) map;
+  if (!cache_matches(h, cst.st_size, src_path, st, scale_denom)) {
+    munmap(map, cst.st_size);
+    return 0;
+  }
+
+  cont->tex_data       = (unsigned char *) map + h->data_offset;
+  cont->width          = h->width;
+  cont->height         = h->height;
+  cont->num_components = h->num_components;
+  cont->color_space    = h->color_space;
+  cont->num_levels     = h->num_levels;
+  cont->scale_denom    = h->scale_denom;
+  cont->cache_map      = map;
+  cont->cache_size     = cst.st_size;
+  return 1;
+}
+
+static int write_all(int fd, const void *data, size_t size)
+{
+  const char *p = data;
+  while (size > 0) {
+    ssize_t n = write(fd, p, size);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return 0;
+    p += n;
+    size -= n;
+  }
+  return 1;
+}
+
+/* creates the directories above the cache file */
+static void make_cache_dirs(const char *cache_path)
+{
+  char dir[PATH_MAX];
+  char *slash;
+
+  strncpy(dir, cache_path, sizeof(dir) - 1);
+  dir[sizeof(dir) - 1] = 0;
+  for (slash = strchr(dir + 1, '/'); slash; slash = strchr(slash + 1, '/')) {
+    *slash = 0;
+    mkdir(dir, 0755);
+    *slash = '/';
+  }
+}
+
+/* the file is written aside and renamed over the old one, so no other
+   process can map it half written */
+static void save_cached_texture(const char *cache_path,
+                                const char *src_path, const struct stat *st,
+                                const struct tex_container *cont)
+{
+  char tmp_path[PATH_MAX];
+  char *head;
+  struct cache_header *h;
+  int fd, ok;
+
+  if (snprintf(tmp_path, sizeof(tmp_path), "%s.%ld.tmp",
+               cache_path, (long) getpid()) >= sizeof(tmp_path))
+    return;
+
+  head = calloc(1, CACHE_DATA_OFFSET);
+  if (head == NULL)
+    return;
+  h = (struct cache_header *) head;
+  memcpy(h->magic, CACHE_MAGIC, sizeof(h->magic));
+  strncpy(h->src_path, src_path, CACHE_PATH_MAX - 1);
+  h->src_size       = st->st_size;
+  h->src_mtime      = st->st_mtime;
+  h->width          = cont->width;
+  h->height         = cont->height;
+  h->num_components = cont->num_components;
+  h->color_space    = cont->color_space;
+  h->num_levels     = cont->num_levels;
+  h->scale_denom    = cont->scale_denom;
+  h->data_offset    = CACHE_DATA_OFFSET;
+
+  make_cache_dirs(cache_path);
+  fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) {
+    free(head);
+    return;
+  }
+  ok = write_all(fd, head, CACHE_DATA_OFFSET) &&
+       write_all(fd, cont->tex_data,
+                 tex_levels_size(cont->width, cont->height,
+                                 cont->num_components, cont->num_levels));
+  ok = (close(fd) == 0) && ok;
+  if (!ok || rename(tmp_path, cache_path) != 0)
+    unlink(tmp_path);
+  free(head);
+}
+
+static void release_texture_data(struct tex_container *cont)
+{
+  if (cont->cache_map)
+    munmap(cont->cache_map, cont->cache_size);
+  else
+    free(cont->tex_data);
+  cont->tex_data = NULL;
+  cont->cache_map = NULL;
+}
+
+/* }}} */
+
+/* {{{ texture loading */
+
+/* Only a cached texture is loaded before the first frame. Else the
+   cube is drawn with a flat placeholder texture while a thread
+   decodes the image, and draw_leaf_moon() uploads it when it is
+   ready. */
+
+struct texture_loader {
   GLuint tex_id;
+  char img_path[PATH_MAX];
+  char cache_path[PATH_MAX];
+  char src_path[PATH_MAX];
+  struct stat st;
+  int has_key;
+  int scale_denom;
+  struct tex_container cont;
+  double decode_time;
+  double mipmap_time;
+  /* for the time to the first frame and to the full texture */
+  double start_time;
+  Bool full_texture;
+  Bool first_frame_shown;
+  Bool full_frame_shown;
+  /* from reshape_leaf_moon(), the image is decoded for it */
+  int view_height;
+#ifdef HAVE_PTHREAD
+  pthread_t thread;
+  pthread_mutex_t lock;
+  Bool running;
+  Bool ready;
+#endif
+};
 
-  GLint  internal_format   = GL_RGB;
-  GLenum pixel_data_format = GL_RGB;
+static struct texture_loader loader;
 
-  char *img_locs[] = {
+static const char *find_image(void)
+{
+  static const char *img_locs[] = {
     "/usr/share/xscreensaver/images/leafmoon.jpg",
     "/usr/local/share/xscreensaver/images/leafmoon.jpg",
     "./leafmoon.jpg",
   };
   int i;
 
-  cont.tex_data = NULL;
   /* TODO find how to handle associated files in xscreensaver */
   for (i=0; i < (sizeof(img_locs) / sizeof(char *)); i++) {
-    if (file_exists (img_locs[i])) {
-      printf("loading image: '%s'\n", img_locs[i]);
-      load_jpeg_file (img_locs[i], &cont);
-      break;
-    }
+    if (file_exists (img_locs[i]))
+      return img_locs[i];
   }
-  if (cont.tex_data == NULL) exit(1);
+  return NULL;
+}
 
-  if (cont.num_components == 3 && cont.color_space == JCS_RGB) {
+/* the slow part, it does not use GL */
+static void decode_texture(struct texture_loader *l)
+{
+  double t0 = get_time(), t1;
+
+  printf("loading image: '%s' at 1/%d\n", l->img_path, l->scale_denom);
+  load_jpeg_file (l->img_path, l->scale_denom, &l->cont);
+  t1 = get_time();
+  build_mipmaps(&l->cont);
+  l->mipmap_time = get_time() - t1;
+  if (l->has_key)
+    save_cached_texture(l->cache_path, l->src_path, &l->st, &l->cont);
+  l->decode_time = t1 - t0;
+}
+
+static void upload_texture(struct texture_loader *l)
+{
+  struct tex_container *cont = &l->cont;
+  GLint  internal_format   = GL_RGB;
+  GLenum pixel_data_format = GL_RGB;
+
+  if (cont->num_components == 3 && cont->color_space == JCS_RGB) {
     internal_format   = GL_RGB;
     pixel_data_format = GL_RGB;
   }
-  if (cont.num_components == 1 && cont.color_space == JCS_GRAYSCALE) {
+  if (cont->num_components == 1 && cont->color_space == JCS_GRAYSCALE) {
     internal_format   = GL_LUMINANCE;
     pixel_data_format = GL_LUMINANCE;
   }
 
+  glBindTexture (GL_TEXTURE_2D, l->tex_id);
+  /* the rows are packed, whatever the width of the level */
+  glPixelStorei (GL_UNPACK_ALIGNMENT, 1);
+  {
+    unsigned int w = cont->width, h = cont->height;
+    unsigned char *level = cont->tex_data;
+    int i;
+    for (i = 0; i < cont->num_levels; i++) {
+      glTexImage2D (GL_TEXTURE_2D, i, internal_format,
+             w, h, 0, pixel_data_format,
+             GL_UNSIGNED_BYTE, level);
+      level += (size_t) w * h * cont->num_components;
+      if (w > 1) w /= 2;
+      if (h > 1) h /= 2;
+    }
+  }
+
+  /* OpenGL has its own copy of texture data */
+  release_texture_data (cont);
+  l->full_texture = True;
+}
+
+#ifdef HAVE_PTHREAD
+static void *decode_thread(void *arg)
+{
+  struct texture_loader *l = (struct texture_loader *) arg;
+  decode_texture(l);
+  pthread_mutex_lock(&l->lock);
+  l->ready = True;
+  pthread_mutex_unlock(&l->lock);
+  return NULL;
+}
+#endif
+
+/* t1 is when the upload began */
+static void report_decode_times(double t1)
+{
+  if (!show_stats)
+    return;
+  fprintf(stderr, "%s: image %ux%u decoded in %.1f ms, mipmaps in %.1f ms, "
+          "uploaded in %.1f ms\n", progname,
+          loader.cont.width, loader.cont.height, loader.decode_time * 1e3,
+          loader.mipmap_time * 1e3, (get_time() - t1) * 1e3);
+}
+
+static GLuint init_texture (void)
+{
+  const char *img_path;
+  unsigned int width, height;
+  GLint max_size = 0;
+  double t0, t1;
+
+  if ((img_path = find_image()) == NULL) exit(1);
+  strncpy(loader.img_path, img_path, PATH_MAX - 1);
+
+  t0 = get_time();
+  glGetIntegerv (GL_MAX_TEXTURE_SIZE, &max_size);
+  loader.scale_denom = 1;
+  if (jpeg_image_size(loader.img_path, &width, &height))
+    loader.scale_denom = choose_scale_denom(width, height,
+                                            loader.view_height, max_size);
+  loader.has_key = cache_file_name(img_path, loader.scale_denom,
+                                   loader.cache_path,
+                                   sizeof(loader.cache_path),
+                                   loader.src_path, &loader.st);
+
   /* generate texture */
-  glGenTextures (1, &tex_id);
-  glBindTexture (GL_TEXTURE_2D, tex_id);
+  glGenTextures (1, &loader.tex_id);
+  glBindTexture (GL_TEXTURE_2D, loader.tex_id);
 
   /* setup some parameters for texture filters and mipmapping */
   glTexParameteri (GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-  glTexParameteri (GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+  /* the mipmaps cost nothing over GL_LINEAR, trilinear ('t') does */
+  glTexParameteri (GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER,
+                   GL_LINEAR_MIPMAP_NEAREST);
+
+  if (loader.has_key &&
+      load_cached_texture(loader.cache_path, loader.src_path, &loader.st,
+                          loader.scale_denom, &loader.cont)) {
+    printf("loading cached image: '%s'\n", loader.cache_path);
+    t1 = get_time();
+    upload_texture(&loader);
+    if (show_stats)
+      fprintf(stderr, "%s: image %ux%u mapped in %.1f ms, "
+              "uploaded in %.1f ms\n", progname,
+              loader.cont.width, loader.cont.height,
+              (t1 - t0) * 1e3, (get_time() - t1) * 1e3);
+    return loader.tex_id;
+  }
 
-  glTexImage2D (GL_TEXTURE_2D, 0, internal_format,
-         cont.width, cont.height, 0, pixel_data_format,
-         GL_UNSIGNED_BYTE, cont.tex_data);
+#ifdef HAVE_PTHREAD
+  {
+    /* the average gray of the moon, until the image is there */
+    static const unsigned char placeholder = 0x60;
+    glTexImage2D (GL_TEXTURE_2D, 0, GL_LUMINANCE, 1, 1, 0,
+                  GL_LUMINANCE, GL_UNSIGNED_BYTE, &placeholder);
+
+    pthread_mutex_init(&loader.lock, NULL);
+    if (pthread_create(&loader.thread, NULL, decode_thread, &loader) == 0) {
+      loader.running = True;
+      return loader.tex_id;
+    }
+    pthread_mutex_destroy(&loader.lock);
+  }
+#endif
 
-  /*
-  gluBuild2DMipmaps (GL_TEXTURE_2D, internal_format,
-         cont.width, cont.height, pixel_data_format,
-         GL_UNSIGNED_BYTE, cont.tex_data);
-  */
+  decode_texture(&loader);
+  t1 = get_time();
+  upload_texture(&loader);
+  report_decode_times(t1);
+  return loader.tex_id;
+}
 
-  /* OpenGL has its own copy of texture data */
-  free (cont.tex_data);
+/* uploads the image once the thread has decoded it */
+static void poll_texture_loader(void)
+{
+#ifdef HAVE_PTHREAD
+  Bool ready;
+  double t1;
+
+  if (!loader.running)
+    return;
+  pthread_mutex_lock(&loader.lock);
+  ready = loader.ready;
+  pthread_mutex_unlock(&loader.lock);
+  if (!ready)
+    return;
+
+  pthread_join(loader.thread, NULL);
+  pthread_mutex_destroy(&loader.lock);
+  loader.running = False;
+
+  t1 = get_time();
+  upload_texture(&loader);
+  report_decode_times(t1);
+#endif
+}
+
+static void release_texture_loader(void)
+{
+#ifdef HAVE_PTHREAD
+  if (loader.running) {
+    pthread_join(loader.thread, NULL);
+    pthread_mutex_destroy(&loader.lock);
+    release_texture_data(&loader.cont);
+  }
+#endif
+  memset(&loader, 0, sizeof(loader));
+}
 
-  return tex_id;
+/* called after each frame is shown */
+static void report_frame_times(void)
+{
+  double t;
+
+  if (!show_stats || (loader.first_frame_shown && loader.full_frame_shown))
+    return;
+  t = (get_time() - loader.start_time) * 1e3;
+  if (!loader.first_frame_shown) {
+    loader.first_frame_shown = True;
+    fprintf(stderr, "%s: first frame after %.1f ms\n", progname, t);
+  }
+  if (loader.full_texture) {
+    loader.full_frame_shown = True;
+    fprintf(stderr, "%s: full texture frame after %.1f ms\n",
+            progname, t);
+  }
 }
 
+/* }}} */
+
 static GLuint init_local_gl(void)
 {
   glEnable(GL_DEPTH_TEST);
@@ -289,15 +1022,100 @@ static void init_app(ModeInfo *mi, struct cube_app *apps[])
 }
 
 
+/* {{{ cube geometry */
+
+/* x, y, z, s, t of the quads of the faces */
+static const GLfloat cube_vertices[24][5] = {
+  { -0.5,  0.5,  0.5,   0.0,  0.25 },
+  { -0.5, -0.5,  0.5,   0.0,  0.5  },
+  {  0.5, -0.5,  0.5,   0.25, 0.5  },
+  {  0.5,  0.5,  0.5,   0.25, 0.25 },
+
+  {  0.5,  0.5,  0.5,   0.25, 0.25 },
+  {  0.5, -0.5,  0.5,   0.25, 0.5  },
+  {  0.5, -0.5, -0.5,   0.5,  0.5  },
+  {  0.5,  0.5, -0.5,   0.5,  0.25 },
+
+  {  0.5,  0.5, -0.5,   0.5,  0.25 },
+  {  0.5, -0.5, -0.5,   0.5,  0.5  },
+  { -0.5, -0.5, -0.5,   0.75, 0.5  },
+  { -0.5,  0.5, -0.5,   0.75, 0.25 },
+
+  { -0.5,  0.5, -0.5,   0.75, 0.25 },
+  { -0.5, -0.5, -0.5,   0.75, 0.5  },
+  { -0.5, -0.5,  0.5,   1.0,  0.5  },
+  { -0.5,  0.5,  0.5,   1.0,  0.25 },
+
+  { -0.5,  0.5, -0.5,   0.0,  0.0  },
+  { -0.5,  0.5,  0.5,   0.0,  0.25 },
+  {  0.5,  0.5,  0.5,   0.25, 0.25 },
+  {  0.5,  0.5, -0.5,   0.25, 0.0  },
+
+  { -0.5, -0.5, -0.5,   0.0,  0.75 },
+  { -0.5, -0.5,  0.5,   0.0,  0.5  },
+  {  0.5, -0.5,  0.5,   0.25, 0.5  },
+  {  0.5, -0.5, -0.5,   0.25, 0.75 },
+};
+
+#define MAX_CUBES 4096
+#define CUBE_SPACING 1.5
+
+/* With -cubes, the cubes are on a grid, each one turned by its own
+   phase. The first one is the single cube of the default. */
+struct cube_set {
+  int count;
+  /* the grid is scaled down to the size of one cube */
+  float scale;
+  /* x, y, z in the grid and the phase of the angles, in degrees */
+  GLfloat (*instances)[4];
+};
+
+static struct cube_set cubes;
+
+static void init_cube_set(int count)
+{
+  int side, i;
+
+  if (count < 1) count = 1;
+  if (count > MAX_CUBES) count = MAX_CUBES;
+  for (side = 1; side * side * side < count; side++)
+    ;
+
+  cubes.count = count;
+  cubes.scale = 1.0 / ((side - 1) * CUBE_SPACING + 1.0);
+  cubes.instances = calloc(count, sizeof(*cubes.instances));
+  if (cubes.instances == NULL) {
+    fprintf(stderr, "out of memory\n");
+    exit(1);
+  }
+
+  for (i = 0; i < count; i++) {
+    GLfloat *inst = cubes.instances[i];
+    float half = (side - 1) * 0.5;
+    inst[0] = ((i % side) - half) * CUBE_SPACING;
+    inst[1] = ((i / side % side) - half) * CUBE_SPACING;
+    inst[2] = ((i / (side * side)) - half) * CUBE_SPACING;
+    inst[3] = (i == 0) ? 0.0 : (float) bound_random(360);
+  }
+}
+
+static void release_cube_set(void)
+{
+  free(cubes.instances);
+  cubes.instances = NULL;
+  cubes.count = 0;
+}
+
+/* }}} */
+
+/* {{{ immediate mode */
+
+/* the path without shaders, also when there is no GL 2.0 */
 static void cube_display (struct cube_app app)
 {
-  glClearColor(0.0, 0.0, 0.0, 0.0);
-  glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
-  glLoadIdentity();
+  int i, v;
 
-  glTranslatef(0.0, 0.0, -1.9);
-  glRotatef(app.angle_y, 1.0, 0.0, 0.0);
-  glRotatef(app.angle_x, 0.0, 1.0, 0.0);
+  glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 
   glMatrixMode(GL_TEXTURE);
   glLoadIdentity();
@@ -307,44 +1125,291 @@ static void cube_display (struct cube_app app)
   glRotatef(app.texture_rot, 0.0, 0.0, 1.0);
   glMatrixMode(GL_MODELVIEW);
 
-  glEnable (GL_TEXTURE_2D); /* begin textured */
+  glEnable(GL_TEXTURE_2D);
   glBindTexture(GL_TEXTURE_2D, app.texture_id);
 
-  glBegin(GL_QUADS);
-  glTexCoord2f(0.0, 0.25);   glVertex3f(-0.5,  0.5,  0.5);
-  glTexCoord2f(0.0, 0.5);    glVertex3f(-0.5, -0.5,  0.5);
-  glTexCoord2f(0.25, 0.5);   glVertex3f( 0.5, -0.5,  0.5);
-  glTexCoord2f(0.25, 0.25);  glVertex3f( 0.5,  0.5,  0.5);
+  for (i = 0; i < cubes.count; i++) {
+    const GLfloat *inst = cubes.instances[i];
+
+    glLoadIdentity();
+    glTranslatef(0.0, 0.0, -1.9);
+    glScalef(cubes.scale, cubes.scale, cubes.scale);
+    glTranslatef(inst[0], inst[1], inst[2]);
+    glRotatef(app.angle_y + inst[3], 1.0, 0.0, 0.0);
+    glRotatef(app.angle_x + inst[3], 0.0, 1.0, 0.0);
 
-  glTexCoord2f(0.25, 0.25);  glVertex3f( 0.5,  0.5,  0.5);
-  glTexCoord2f(0.25, 0.5);   glVertex3f( 0.5, -0.5,  0.5);
-  glTexCoord2f(0.5, 0.5);    glVertex3f( 0.5, -0.5, -0.5);
-  glTexCoord2f(0.5, 0.25);   glVertex3f( 0.5,  0.5, -0.5);
+    glBegin(GL_QUADS);
+    for (v = 0; v < 24; v++) {
+      glTexCoord2fv(cube_vertices[v] + 3);
+      glVertex3fv(cube_vertices[v]);
+    }
+    glEnd();
+  }
+}
+
+/* }}} */
+
+/* {{{ shader path */
+
+#if defined(HAVE_GLSL) && defined(GL_VERSION_2_0)
+
+/* The cube is in a static buffer, and its transforms are uniforms:
+   a frame sets two of them and makes one draw call, instanced for
+   all the cubes when GL 3.3 can do it. */
+
+#define POSITION_ATTRIB 0
+#define TEXCOORD_ATTRIB 1
+#define INSTANCE_ATTRIB 2
+
+static const char *cube_vertex_src =
+  "attribute vec3 position;\n"
+  "attribute vec2 texcoord;\n"
+  "attribute vec4 instance;\n"
+  "uniform mat4 view;\n"
+  "uniform vec2 angles;\n"
+  "uniform mat3 tex_matrix;\n"
+  "varying vec2 uv;\n"
+  "\n"
+  "void main() {\n"
+  "  vec2 a = radians(angles + instance.w);\n"
+  "  vec3 p = position;\n"
+  /* about y by angle_x, then about x by angle_y, as glRotatef() did */
+  "  p = vec3(cos(a.x) * p.x + sin(a.x) * p.z, p.y,\n"
+  "           cos(a.x) * p.z - sin(a.x) * p.x);\n"
+  "  p = vec3(p.x, cos(a.y) * p.y - sin(a.y) * p.z,\n"
+  "           sin(a.y) * p.y + cos(a.y) * p.z);\n"
+  "  uv = (tex_matrix * vec3(texcoord, 1.0)).xy;\n"
+  "  gl_Position = gl_ProjectionMatrix * view * vec4(p + instance.xyz, 1.0);\n"
+  "}\n";
+
+static const char *cube_fragment_src =
+  "uniform sampler2D tex;\n"
+  "varying vec2 uv;\n"
+  "\n"
+  "void main() {\n"
+  "  gl_FragColor = texture2D(tex, uv);\n"
+  "}\n";
+
+struct cube_program {
+  GLuint prog;
+  GLuint vbo;
+  GLuint ibo;
+  GLuint instance_vbo;
+  GLint angles;
+  GLint tex_matrix;
+  Bool instanced;
+};
 
-  glTexCoord2f(0.5, 0.25);   glVertex3f( 0.5,  0.5, -0.5);
-  glTexCoord2f(0.5, 0.5);    glVertex3f( 0.5, -0.5, -0.5);
-  glTexCoord2f(0.75, 0.5);   glVertex3f(-0.5, -0.5, -0.5);
-  glTexCoord2f(0.75, 0.25);  glVertex3f(-0.5,  0.5, -0.5);
+static struct cube_program cube_prog;
 
-  glTexCoord2f(0.75, 0.25);  glVertex3f(-0.5,  0.5, -0.5);
-  glTexCoord2f(0.75, 0.5);   glVertex3f(-0.5, -0.5, -0.5);
-  glTexCoord2f(1.0, 0.5);    glVertex3f(-0.5, -0.5,  0.5);
-  glTexCoord2f(1.0, 0.25);   glVertex3f(-0.5,  0.5,  0.5);
+/* the texture matrix of the frame, column major:
+     glScalef(1.4, 1.4, 1.4);
+     glTranslatef(0.0, texture_y, 0.0);
+     glRotatef(texture_rot, 0.0, 0.0, 1.0); */
+static void build_texture_matrix(const struct cube_app *app, GLfloat *m)
+{
+  float s = 1.4;
+  float a = app->texture_rot * (M_PI / 180.0);
+  float c = cosf(a), n = sinf(a);
 
-  glTexCoord2f(0.0, 0.0);    glVertex3f(-0.5,  0.5, -0.5);
-  glTexCoord2f(0.0, 0.25);   glVertex3f(-0.5,  0.5,  0.5);
-  glTexCoord2f(0.25, 0.25);  glVertex3f( 0.5,  0.5,  0.5);
-  glTexCoord2f(0.25, 0.0);   glVertex3f( 0.5,  0.5, -0.5);
+  m[0] = s * c;  m[3] = -s * n;  m[6] = 0.0;
+  m[1] = s * n;  m[4] =  s * c;  m[7] = s * app->texture_y;
+  m[2] = 0.0;    m[5] =  0.0;    m[8] = 1.0;
+}
 
-  glTexCoord2f(0.0, 0.75);   glVertex3f(-0.5, -0.5, -0.5);
-  glTexCoord2f(0.0, 0.5);    glVertex3f(-0.5, -0.5,  0.5);
-  glTexCoord2f(0.25, 0.5);   glVertex3f( 0.5, -0.5,  0.5);
-  glTexCoord2f(0.25, 0.75);  glVertex3f( 0.5, -0.5, -0.5);
-  glEnd();
+static int gl_version_at_least(int major, int minor)
+{
+  const char *version = (const char *) glGetString(GL_VERSION);
+  int vmaj, vmin;
+  if (version == NULL || sscanf(version, "%d.%d", &vmaj, &vmin) != 2)
+    return 0;
+  return (vmaj > major || (vmaj == major && vmin >= minor));
+}
 
-  glDisable (GL_TEXTURE_2D); /* end of textured */
+static GLuint compile_cube_shader(GLenum type, const char *src)
+{
+  GLuint shader;
+  GLint ok;
+
+  shader = glCreateShader(type);
+  glShaderSource(shader, 1, &src, NULL);
+  glCompileShader(shader);
+  glGetShaderiv(shader, GL_COMPILE_STATUS, &ok);
+  if (!ok) {
+    char log[1024];
+    glGetShaderInfoLog(shader, sizeof(log), NULL, log);
+    fprintf(stderr, "%s: cube shader: %s\n", progname, log);
+    glDeleteShader(shader);
+    return 0;
+  }
+  return shader;
 }
 
+static void init_cube_program(void)
+{
+  GLuint vs, fs, prog;
+  GLint ok;
+  GLfloat view[16];
+
+  memset(&cube_prog, 0, sizeof(cube_prog));
+  if (!use_shaders || !gl_version_at_least(2, 0))
+    return;
+
+  vs = compile_cube_shader(GL_VERTEX_SHADER, cube_vertex_src);
+  fs = compile_cube_shader(GL_FRAGMENT_SHADER, cube_fragment_src);
+  if (vs == 0 || fs == 0) {
+    if (vs) glDeleteShader(vs);
+    if (fs) glDeleteShader(fs);
+    return;
+  }
+
+  prog = glCreateProgram();
+  glAttachShader(prog, vs);
+  glAttachShader(prog, fs);
+  glBindAttribLocation(prog, POSITION_ATTRIB, "position");
+  glBindAttribLocation(prog, TEXCOORD_ATTRIB, "texcoord");
+  glBindAttribLocation(prog, INSTANCE_ATTRIB, "instance");
+  glLinkProgram(prog);
+  glDeleteShader(vs);
+  glDeleteShader(fs);
+
+  glGetProgramiv(prog, GL_LINK_STATUS, &ok);
+  if (!ok) {
+    char log[1024];
+    glGetProgramInfoLog(prog, sizeof(log), NULL, log);
+    fprintf(stderr, "%s: cube program: %s\n", progname, log);
+    glDeleteProgram(prog);
+    return;
+  }
+  cube_prog.prog = prog;
+  cube_prog.angles = glGetUniformLocation(prog, "angles");
+  cube_prog.tex_matrix = glGetUniformLocation(prog, "tex_matrix");
+
+  /* what does not change from a frame to the next one */
+  memset(view, 0, sizeof(view));
+  view[0] = view[5] = view[10] = cubes.scale;
+  view[14] = -1.9;
+  view[15] = 1.0;
+  glUseProgram(prog);
+  glUniformMatrix4fv(glGetUniformLocation(prog, "view"), 1, GL_FALSE, view);
+  glUniform1i(glGetUniformLocation(prog, "tex"), 0);
+  glUseProgram(0);
+
+  glGenBuffers(1, &cube_prog.vbo);
+  glBindBuffer(GL_ARRAY_BUFFER, cube_prog.vbo);
+  glBufferData(GL_ARRAY_BUFFER, sizeof(cube_vertices), cube_vertices,
+               GL_STATIC_DRAW);
+
+  /* the quads as triangles, instanced quads are much slower in Mesa */
+  {
+    GLubyte indices[36];
+    int q;
+    for (q = 0; q < 6; q++) {
+      indices[q * 6 + 0] = q * 4 + 0;
+      indices[q * 6 + 1] = q * 4 + 1;
+      indices[q * 6 + 2] = q * 4 + 2;
+      indices[q * 6 + 3] = q * 4 + 0;
+      indices[q * 6 + 4] = q * 4 + 2;
+      indices[q * 6 + 5] = q * 4 + 3;
+    }
+    glGenBuffers(1, &cube_prog.ibo);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, cube_prog.ibo);
+    glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(indices), indices,
+                 GL_STATIC_DRAW);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+  }
+
+#ifdef GL_VERSION_3_3
+  if (cubes.count > 1 && gl_version_at_least(3, 3)) {
+    cube_prog.instanced = True;
+    glGenBuffers(1, &cube_prog.instance_vbo);
+    glBindBuffer(GL_ARRAY_BUFFER, cube_prog.instance_vbo);
+    glBufferData(GL_ARRAY_BUFFER,
+                 cubes.count * sizeof(*cubes.instances), cubes.instances,
+                 GL_STATIC_DRAW);
+  }
+#endif
+  glBindBuffer(GL_ARRAY_BUFFER, 0);
+}
+
+static void release_cube_program(void)
+{
+  if (cube_prog.prog == 0)
+    return;
+  glDeleteProgram(cube_prog.prog);
+  glDeleteBuffers(1, &cube_prog.vbo);
+  glDeleteBuffers(1, &cube_prog.ibo);
+  if (cube_prog.instance_vbo)
+    glDeleteBuffers(1, &cube_prog.instance_vbo);
+  memset(&cube_prog, 0, sizeof(cube_prog));
+}
+
+static void cube_display_shader (const struct cube_app *app)
+{
+  GLfloat tex_matrix[9];
+  int stride = sizeof(cube_vertices[0]);
+  int i;
+
+  glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+
+  build_texture_matrix(app, tex_matrix);
+  glUseProgram(cube_prog.prog);
+  glUniform2f(cube_prog.angles, app->angle_x, app->angle_y);
+  glUniformMatrix3fv(cube_prog.tex_matrix, 1, GL_FALSE, tex_matrix);
+
+  /* the buffers are only bound while drawing, the fps overlay draws
+     from client arrays */
+  glBindTexture(GL_TEXTURE_2D, app->texture_id);
+  glBindBuffer(GL_ARRAY_BUFFER, cube_prog.vbo);
+  glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, cube_prog.ibo);
+  glVertexAttribPointer(POSITION_ATTRIB, 3, GL_FLOAT, GL_FALSE, stride,
+                        (const GLvoid *) 0);
+  glVertexAttribPointer(TEXCOORD_ATTRIB, 2, GL_FLOAT, GL_FALSE, stride,
+                        (const GLvoid *) (3 * sizeof(GLfloat)));
+  glEnableVertexAttribArray(POSITION_ATTRIB);
+  glEnableVertexAttribArray(TEXCOORD_ATTRIB);
+
+#ifdef GL_VERSION_3_3
+  if (cube_prog.instanced) {
+    glBindBuffer(GL_ARRAY_BUFFER, cube_prog.instance_vbo);
+    glVertexAttribPointer(INSTANCE_ATTRIB, 4, GL_FLOAT, GL_FALSE, 0,
+                          (const GLvoid *) 0);
+    glVertexAttribDivisor(INSTANCE_ATTRIB, 1);
+    glEnableVertexAttribArray(INSTANCE_ATTRIB);
+    glDrawElementsInstanced(GL_TRIANGLES, 36, GL_UNSIGNED_BYTE,
+                            (const GLvoid *) 0, cubes.count);
+    glDisableVertexAttribArray(INSTANCE_ATTRIB);
+  }
+  else
+#endif
+  for (i = 0; i < cubes.count; i++) {
+    glVertexAttrib4fv(INSTANCE_ATTRIB, cubes.instances[i]);
+    glDrawElements(GL_TRIANGLES, 36, GL_UNSIGNED_BYTE, (const GLvoid *) 0);
+  }
+
+  glDisableVertexAttribArray(POSITION_ATTRIB);
+  glDisableVertexAttribArray(TEXCOORD_ATTRIB);
+  glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+  glBindBuffer(GL_ARRAY_BUFFER, 0);
+  glUseProgram(0);
+}
+
+static Bool shaders_ready(void)
+{
+  return (cube_prog.prog != 0);
+}
+
+#else /* !HAVE_GLSL */
+
+static void init_cube_program(void) { }
+static void release_cube_program(void) { }
+static void cube_display_shader (const struct cube_app *app) { }
+static Bool shaders_ready(void) { return False; }
+
+#endif /* !HAVE_GLSL */
+
+/* }}} */
+
 static void animation_ticks(struct cube_app *app)
 {
   app->angle_x += 0.12;
@@ -375,6 +1440,7 @@ ENTRYPOINT void init_leaf_moon(ModeInfo *mi)
   window = MI_WINDOW(mi);
   screen = MI_SCREEN(mi);
 
+  loader.start_time = get_time();
   glx_context = init_GL(mi);
 
   if (glx_context == NULL)
@@ -391,7 +1457,9 @@ ENTRYPOINT void init_leaf_moon(ModeInfo *mi)
 
     reshape_leaf_moon(mi, MI_WIDTH(mi), MI_HEIGHT(mi));
     init_app(mi, &app_storage);
+    init_cube_set(num_cubes);
     tex_id = init_local_gl();
+    init_cube_program();
     for (i=0; i<num_screens; ++i) {
       app_storage[i].texture_id = tex_id;
     }
@@ -418,9 +1486,14 @@ ENTRYPOINT void draw_leaf_moon(ModeInfo *mi)
 
   screen = MI_SCREEN(mi);
 
+  poll_texture_loader();
+
   {
     /* display */
-    cube_display(app_storage[screen]);
+    if (shaders_ready())
+      cube_display_shader(&app_storage[screen]);
+    else
+      cube_display(app_storage[screen]);
 
     /* animate */
     animation_ticks(&(app_storage[screen]));
@@ -429,10 +1502,13 @@ ENTRYPOINT void draw_leaf_moon(ModeInfo *mi)
   if (mi->fps_p) do_fps (mi);
   glFinish();
   glXSwapBuffers(display, window);
+
+  report_frame_times();
 }
 
 ENTRYPOINT void reshape_leaf_moon(ModeInfo *mi, int width, int height)
 {
+  loader.view_height = height;
   glViewport(0, 0, (GLint) width, (GLint) height);
   glMatrixMode(GL_PROJECTION);
   glLoadIdentity();
@@ -451,6 +1527,16 @@ static Bool keyboard(struct cube_app * app, char key) {
       glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
       glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
       return True;
+    case 'm':
+      glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+      glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER,
+                      GL_LINEAR_MIPMAP_NEAREST);
+      return True;
+    case 't':
+      glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+      glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER,
+                      GL_LINEAR_MIPMAP_LINEAR);
+      return True;
     default:
       return False;
   }
@@ -478,6 +1564,9 @@ ENTRYPOINT void refresh_leaf_moon(ModeInfo *mi)
 
 ENTRYPOINT void release_leaf_moon(ModeInfo *mi)
 {
+  release_texture_loader();
+  release_cube_program();
+  release_cube_set();
   glDeleteTextures (1, &(app_storage[0].texture_id));
   free(app_storage);
   app_storage = NULL;
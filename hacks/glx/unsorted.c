@@ -17,7 +17,26 @@
  */
 
 #include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <limits.h>
 #include <math.h>
+#include <sys/time.h>
+
+#ifdef __SSE__
+# include <xmmintrin.h>
+#endif
+#ifdef __SSE2__
+# include <emmintrin.h>
+#endif
+
+#ifdef HAVE_PTHREAD
+# include <pthread.h>
+# include <unistd.h>
+#endif
+
+/* for the buffer objects entry points */
+#define GL_GLEXT_PROTOTYPES
 
 #ifdef STANDALONE
 # define DEFAULTS	\
@@ -29,14 +48,92 @@
 # include "xlock.h"			/* in xlockmore distribution */
 #endif /* STANDALONE */
 
+#ifdef HAVE_XSHM_EXTENSION
+# include <sys/ipc.h>
+# include <sys/shm.h>
+# include <X11/extensions/XShm.h>
+#endif
+
 
 #ifdef USE_GL
 
+#undef countof
+#define countof(x) (sizeof((x))/sizeof((*x)))
+
+#define DEF_SIDE        "7"
+#define DEF_ROWS        "6"
+#define DEF_SEGMENTS    "24"
+#define DEF_ORDER       "auto"
+#define DEF_SORT_BENCH  "False"
+#define DEF_STATS       "False"
+#define DEF_SINGLE_PASS "False"
+#define DEF_THREADS     "0"
+#define DEF_BENCHMARK   "0"
+#define DEF_CULL        "True"
+#define DEF_OVERDRAW    "False"
+#define DEF_BACKEND     "gl"
+#define DEF_ZBUFFER     "False"
+#define DEF_LOD         "True"
+
+
+static int lattice_side;
+static int cyl_rows;
+static int cyl_segments;
+static char *order_str;
+static Bool sort_bench;
+static Bool show_stats;
+static Bool single_pass;
+static int num_threads;
+static int bench_frames;
+static Bool do_cull;
+static Bool overdraw;
+static char *backend_str;
+static Bool zbuffer;
+static Bool use_lod;
+
+static XrmOptionDescRec opts[] = {
+  { "-side",       ".side",      XrmoptionSepArg, 0 },
+  { "-rows",       ".rows",      XrmoptionSepArg, 0 },
+  { "-segments",   ".segments",  XrmoptionSepArg, 0 },
+  { "-order",      ".order",     XrmoptionSepArg, 0 },
+  { "-sort-bench", ".sortBench", XrmoptionNoArg, "True" },
+  { "-stats",      ".stats",     XrmoptionNoArg, "True" },
+  { "-no-stats",   ".stats",     XrmoptionNoArg, "False" },
+  { "-single-pass",    ".singlePass", XrmoptionNoArg, "True" },
+  { "-no-single-pass", ".singlePass", XrmoptionNoArg, "False" },
+  { "-threads",    ".threads",   XrmoptionSepArg, 0 },
+  { "-benchmark",  ".benchmark", XrmoptionSepArg, 0 },
+  { "-cull",       ".cull",      XrmoptionNoArg, "True" },
+  { "-no-cull",    ".cull",      XrmoptionNoArg, "False" },
+  { "-overdraw",   ".overdraw",  XrmoptionNoArg, "True" },
+  { "-no-overdraw",".overdraw",  XrmoptionNoArg, "False" },
+  { "-backend",    ".backend",   XrmoptionSepArg, 0 },
+  { "-zbuffer",    ".zbuffer",   XrmoptionNoArg, "True" },
+  { "-no-zbuffer", ".zbuffer",   XrmoptionNoArg, "False" },
+  { "-lod",        ".lod",       XrmoptionNoArg, "True" },
+  { "-no-lod",     ".lod",       XrmoptionNoArg, "False" },
+};
 
-ENTRYPOINT ModeSpecOpt unsorted_opts = {
-  0, NULL, 0, NULL, NULL
+static argtype vars[] = {
+  {&lattice_side, "side",    "Side",      DEF_SIDE,       t_Int},
+  {&cyl_rows,   "rows",      "Rows",      DEF_ROWS,       t_Int},
+  {&cyl_segments, "segments", "Segments", DEF_SEGMENTS,   t_Int},
+  {&order_str,  "order",     "Order",     DEF_ORDER,      t_String},
+  {&sort_bench, "sortBench", "SortBench", DEF_SORT_BENCH, t_Bool},
+  {&show_stats, "stats",     "Stats",     DEF_STATS,      t_Bool},
+  {&single_pass, "singlePass", "SinglePass", DEF_SINGLE_PASS, t_Bool},
+  {&num_threads, "threads",  "Threads",   DEF_THREADS,    t_Int},
+  {&bench_frames, "benchmark", "Benchmark", DEF_BENCHMARK, t_Int},
+  {&do_cull,    "cull",      "Cull",      DEF_CULL,       t_Bool},
+  {&overdraw,   "overdraw",  "Overdraw",  DEF_OVERDRAW,   t_Bool},
+  {&backend_str, "backend",  "Backend",   DEF_BACKEND,    t_String},
+  {&zbuffer,    "zbuffer",   "Zbuffer",   DEF_ZBUFFER,    t_Bool},
+  {&use_lod,    "lod",       "Lod",       DEF_LOD,        t_Bool},
 };
 
+ENTRYPOINT ModeSpecOpt unsorted_opts =
+  {countof(opts), opts, countof(vars), vars, NULL};
+
 #ifdef USE_MODULES
 ModStruct  unsorted_description =
   { "unsorted",
@@ -49,32 +146,48 @@ ModStruct  unsorted_description =
 #endif
 
 
-/* number of cubes along each axis */
-#define SIDE 7
+/* the number of cubes along each axis (-side), of cylinders around
+   the circle (-segments) and of cylinder rows (-rows) are set at run
+   time, the scene buffers are sized from them */
+#define MAX_SIDE 256
+#define MAX_SEGMENTS 100000
+#define MAX_ROWS 100000
 
-/* total number of cubes */
-#define NB_CUBES (SIDE * SIDE * SIDE)
+/* the items are counted and indexed with int all along, and take about
+   100 bytes each in the scene buffers */
+#define MAX_ITEMS (MAX_SIDE * MAX_SIDE * MAX_SIDE)
 
-/* number of segments in circles */
+/* number of segments in the circles of a cylinder */
 #define CIRC_SEGi 16
 #define CIRC_SEGf 16.0f
 
-#define CIRC_SEGi2 24
-#define CIRC_SEGf2 24.0f
+/* the segments of the cylinders for each level of detail, the
+   first one is CIRC_SEGi */
+#define NB_CYLINDER_LODS 4
+static const int cylinder_lod_segments[NB_CYLINDER_LODS] = { 16, 12, 8, 6 };
 
-/* number of cylinder rows */
-#define CYL_ZN 6
+#define TWO_PI (M_PI * 2.0)
 
-/* total number of cylinders */
-#define NB_CYLINDERS (CIRC_SEGi2 * CYL_ZN)
+/* vertical field of view, the projection has an aspect of 1 */
+#define VIEW_FOVY 60.0
 
-#define TWO_PI (M_PI * 2.0)
+/* cells of the coverage grid of the occlusion culling, over the
+   whole viewport */
+#define COVER_GRID 256
 
+/* most projected points of a convex hull, the vertices of a shell */
+#define HULL_MAX_POINTS (2 * CIRC_SEGi)
 
-#define bound_random(bound) (random() % bound)
+/* frames between two reports of the statistics */
+#define STATS_FRAMES 100
+
+/* the per item work of a frame is split among threads
+   by chunks of at least PAR_MIN_ITEMS items */
+#define MAX_THREADS 64
+#define PAR_MIN_ITEMS 16384
 
-#define mat_get_z(mat) ((mat)[14])
-#define mat_get_y(mat) ((mat)[13])
+
+#define bound_random(bound) (random() % bound)
 
 
 enum geom_type {
@@ -82,30 +195,134 @@ enum geom_type {
   CYLINDER_GEOM = 1
 };
 
-struct cube_struct {
-  float r, g, b;
-  int vis;
-  GLfloat mat[16];
+/* how the painter's order is obtained, auto takes the lattice
+   traversal for the cubes and the BSP tree for the cylinders, the
+   lattice traversal only applies to the cubes */
+enum draw_order {
+  ORDER_AUTO = 0,
+  ORDER_SORT = 1,
+  ORDER_LATTICE = 2,
+  ORDER_BSP = 3
 };
 
-struct cylinder_struct {
-  float r, g, b;
-  int vis;
-  GLfloat mat[16];
+/* depth key of an item, the bits of its view space z
+   made sortable as an unsigned integer */
+struct sort_key {
+  unsigned int key;
+  unsigned int index;
+};
+
+/* a node splits the items with the plane pos[axis] = split, the items
+   below go to child[0] and the others to child[1], no item crosses the
+   plane; a leaf (axis < 0) holds count items from first in items, more
+   than one only when they overlap and no plane can separate them */
+struct bsp_node {
+  int axis;
+  float split;
+  int child[2];
+  int first, count;
 };
 
+/* built on the first frame which needs it, the stack is for the
+   traversal */
+struct bsp_tree {
+  Bool built;
+  int num_nodes;
+  struct bsp_node *nodes;  /* 2 * n - 1 at most */
+  int *items;
+  int *stack;
+};
+
+/* all the buffers of a scene are carved from one block, which is
+   sized by a first layout pass made without memory */
+struct scene_arena {
+  char *base;
+  size_t size;
+  size_t used;
+};
+
+/* the positions of the items never change, they are stored
+   once as separated x, y, z arrays for the transform kernel,
+   view_pos is the same in view space, the modelview matrix of
+   an item is the view matrix with this position as translation,
+   all the arrays have num_items entries */
 struct cube_geom {
-  struct cube_struct cubes[NB_CUBES];
-  int colors[NB_CUBES];
-  int visibility[NB_CUBES];
+  int side;
+  int num_items;
+  unsigned char *colors;     /* index in the palette */
+  unsigned int *visibility;  /* bitset */
+  float *pos[3];
+  float *view_pos[3];
+  float *rgb;  /* 3 * num_items, the colors of the frame */
+  struct sort_key *keys;
+  struct sort_key *keys_tmp;
+  int *axis_order;  /* 3 * side, for the lattice traversal */
+  struct bsp_tree bsp;
+  Bool culled;              /* hidden is valid for this frame */
+  int num_hidden;
+  unsigned int *hidden;     /* bitset, the cubes found fully covered */
+  unsigned char *cover;     /* COVER_GRID^2 coverage grid */
 };
 
 struct cylinder_geom {
-  struct cylinder_struct cylinders[NB_CYLINDERS];
-  int colors[NB_CYLINDERS];
-  int visibility[NB_CYLINDERS];
-  float circ_cache[CIRC_SEGi][2];
-  float circ_cache2[CIRC_SEGi][2];
+  int segments;
+  int rows;
+  int num_items;
+  unsigned char *colors;     /* index in the palette */
+  unsigned int *visibility;  /* bitset */
+  float (*circ_cache2)[2];  /* segments entries */
+  float *pos[3];
+  float *view_pos[3];
+  float *rgb;  /* 3 * num_items, the colors of the frame */
+  struct sort_key *keys;
+  struct sort_key *keys_tmp;
+  struct bsp_tree bsp;
+};
+
+/* work counters, reported with -stats */
+struct frame_stats {
+  unsigned long frames;
+  unsigned long sort_moves;      /* keys moved by the incremental sort */
+  unsigned long sort_max_moves;  /* the most in one frame */
+  unsigned long sort_full;       /* frames which needed a full sort */
+  unsigned long occluded;        /* cubes skipped by the occlusion culling */
+  unsigned long lod_items[NB_CYLINDER_LODS];  /* cylinders drawn */
+  double fragments;              /* with -overdraw */
+};
+
+#ifdef HAVE_PTHREAD
+/* each screen has a thread that prepares its next frame (animation,
+   transform and drawing order) while the other screens are drawn,
+   busy is set while a frame is being prepared */
+struct frame_worker {
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  Bool running;
+  Bool busy;
+  Bool quit;
+};
+#endif
+
+/* the meshes of the items, the cylinder one for each level of detail */
+enum {
+  CUBE_MESH = 0,
+  CYLINDER_MESH = 1,
+  NB_MESHES = CYLINDER_MESH + NB_CYLINDER_LODS
+};
+
+/* the frame buffer of -backend soft, an XImage in shared
+   memory when the X server has the extension */
+struct soft_target {
+  XImage *image;             /* NULL until the first reshape */
+  GC gc;
+#ifdef HAVE_XSHM_EXTENSION
+  Bool shm;
+  XShmSegmentInfo shm_info;
+#endif
+  int shift[3];              /* of the red, green and blue bytes */
+  struct soft_item *items;   /* one chunk of items, set up */
+  float *span;               /* left and right ends, 2 * height */
 };
 
 union geom_disp {
@@ -119,70 +336,207 @@ struct app_contents {
   float angley;
   int draw_mode;
   enum geom_type type;
+  enum draw_order order;
+  int sort_valid;
+  struct frame_stats stats;
+  int use_vbo;
+  GLuint vbo[NB_MESHES];
+  GLuint ibo[NB_MESHES];
+  GLuint outline_prog;   /* 0 when the single pass is not available */
+  GLint outline_shape, outline_inner, outline_pixel;
+  Bool single_pass;
+  Bool zbuffer;          /* depth tested, drawn front to back */
+  float pixel_angle;     /* size of a pixel at distance 1 */
+  GLuint frag_query;     /* 0 when the overdraw is not measured */
+  unsigned long pixels;  /* of the viewport */
+#ifdef DEBUG
+  Bool parity_check;
+#endif
+  GLfloat view[16];
+  struct sort_key *frame_order;  /* drawing order of the prepared frame */
+  Bool frame_ready;
+#ifdef HAVE_PTHREAD
+  struct frame_worker worker;
+#endif
+  Bool soft;             /* drawn by the software backend */
+  struct soft_target soft_fb;
+  struct scene_arena arena;
+  struct radix_job *radix;  /* histograms of the parallel sort */
   union geom_disp geom;
 };
 
 
+static void bad_index(const char *what, int index, int n)
+{
+  fprintf(stderr, "%s: %s index %d out of range [0, %d)\n",
+          progname, what, index, n);
+  abort();
+}
+
+#define check_index(what, index, n) \
+  do { \
+    if ((unsigned int) (index) >= (unsigned int) (n)) \
+      bad_index((what), (index), (n)); \
+  } while (0)
+
+static void *arena_alloc(struct scene_arena *arena, size_t count, size_t size)
+{
+  size_t start;
+
+  if (size != 0 && count > ((size_t) -1 - 16) / size) {
+    fprintf(stderr, "%s: scene too large\n", progname);
+    exit(1);
+  }
+
+  /* 16 bytes aligned for the SIMD kernels */
+  start = (arena->used + 15) & ~((size_t) 15);
+
+  if (arena->base != NULL && start + count * size > arena->size) {
+    fprintf(stderr, "%s: scene arena overflow\n", progname);
+    abort();
+  }
+
+  arena->used = start + count * size;
+  if (arena->base == NULL)
+    return NULL;
+  return arena->base + start;
+}
+
+static void free_arena(struct scene_arena *arena)
+{
+  free(arena->base);
+  arena->base = NULL;
+  arena->size = 0;
+  arena->used = 0;
+}
+
+
+/* the visibility of the items is a bitset, one bit per item */
+#define VIS_WORD_BITS 32
+#define vis_words(n) (((n) + VIS_WORD_BITS - 1) / VIS_WORD_BITS)
+
+static int get_vis_bit(const unsigned int *bits, int index)
+{
+  return (bits[index / VIS_WORD_BITS] >> (index % VIS_WORD_BITS)) & 1;
+}
+
+static void set_vis_bit(unsigned int *bits, int index, int value)
+{
+  unsigned int mask = 1u << (index % VIS_WORD_BITS);
+  if (value)
+    bits[index / VIS_WORD_BITS] |= mask;
+  else
+    bits[index / VIS_WORD_BITS] &= ~mask;
+}
+
+/* each item mutates with probability 10 / threshold, as with
+   bound_random(threshold) < 10 per item, but instead of drawing a
+   number for every item the gap to the next mutated item is drawn
+   from the geometric distribution, so a frame costs one random()
+   per change and not one per item */
+static double mutation_log_q(int threshold)
+{
+  if (threshold <= 10)
+    return 0.0;
+  return log1p(-10.0 / threshold);
+}
+
+static int mutation_skip(double log_q)
+{
+  double u, skip;
+
+  if (log_q == 0.0)
+    return 0;
+
+  /* u in (0, 1], random() returns 31 bits */
+  u = ((double) random() + 1.0) / 2147483648.0;
+  skip = floor(log(u) / log_q);
+  if (skip > INT_MAX)
+    return INT_MAX;
+  return (int) skip;
+}
+
+static void flip_random_bits(unsigned int *bits, int n, int threshold)
+{
+  double log_q = mutation_log_q(threshold);
+  int i = mutation_skip(log_q);
+
+  while (i < n) {
+    bits[i / VIS_WORD_BITS] ^= 1u << (i % VIS_WORD_BITS);
+    i += 1 + mutation_skip(log_q);
+    if (i < 0)  /* overflow */
+      break;
+  }
+}
+
+static void recolor_random(unsigned char *colors, int n, int threshold)
+{
+  double log_q = mutation_log_q(threshold);
+  int i = mutation_skip(log_q);
+
+  while (i < n) {
+    colors[i] = bound_random(4);
+    i += 1 + mutation_skip(log_q);
+    if (i < 0)
+      break;
+  }
+}
+
 static void init_cubes_visibility(struct app_contents *app) {
   int i;
-  for (i=0; i < NB_CUBES; i++)
-    app->geom.cube_app.visibility[i] = bound_random(2);
+  for (i=0; i < app->geom.cube_app.num_items; i++)
+    set_vis_bit(app->geom.cube_app.visibility, i, bound_random(2));
 }
 
 static void init_cylinder_visibility(struct app_contents *app) {
   int i;
-  for (i=0; i < NB_CUBES; i++) {
-    if (bound_random(300) < 20)
-      app->geom.cylinder_app.visibility[i] = 0;
-    else
-      app->geom.cylinder_app.visibility[i] = 1;
-  }
+  for (i=0; i < app->geom.cylinder_app.num_items; i++)
+    set_vis_bit(app->geom.cylinder_app.visibility, i,
+                !(bound_random(300) < 20));
 }
 
-static int get_cube_visibility(struct app_contents app, int index) {
-  return app.geom.cube_app.visibility[index];
+static int get_cube_visibility(const struct app_contents *app, int index) {
+  check_index("cube", index, app->geom.cube_app.num_items);
+  return get_vis_bit(app->geom.cube_app.visibility, index);
 }
 
-static int get_cylinder_visibility(struct app_contents app, int index) {
-  return app.geom.cylinder_app.visibility[index];
+static int get_cylinder_visibility(const struct app_contents *app, int index) {
+  check_index("cylinder", index, app->geom.cylinder_app.num_items);
+  return get_vis_bit(app->geom.cylinder_app.visibility, index);
 }
 
 static void step_visibility(struct app_contents *app, int threshold) {
-  int i;
   switch (app->type)
   {
     case CUBE_GEOM:
-      for (i=0; i < NB_CUBES; i++)
-        if (bound_random(threshold) < 10)
-          app->geom.cube_app.visibility[i] =
-            !app->geom.cube_app.visibility[i];
+      flip_random_bits(app->geom.cube_app.visibility,
+                       app->geom.cube_app.num_items, threshold);
       break;
 
     case CYLINDER_GEOM:
-      for (i=0; i < NB_CYLINDERS; i++)
-        if (bound_random(threshold) < 10)
-          app->geom.cylinder_app.visibility[i] =
-            !app->geom.cylinder_app.visibility[i];
+      flip_random_bits(app->geom.cylinder_app.visibility,
+                       app->geom.cylinder_app.num_items, threshold);
       break;
   }
 }
 
 static void init_cubes_color(struct app_contents *app) {
   int i;
-  for (i=0; i < NB_CUBES; i++)
+  for (i=0; i < app->geom.cube_app.num_items; i++)
     app->geom.cube_app.colors[i] = bound_random(4);
 }
 
 static void init_cylinders_color(struct app_contents *app) {
   int i;
-  for (i=0; i < NB_CYLINDERS; i++)
+  for (i=0; i < app->geom.cylinder_app.num_items; i++)
     app->geom.cylinder_app.colors[i] = bound_random(4);
 }
 
-static void get_cube_color(struct app_contents app,
+static void get_cube_color(const struct app_contents *app,
                            int index, float *r, float *g, float *b)
 {
-  switch (app.geom.cube_app.colors[index]) {
+  check_index("cube", index, app->geom.cube_app.num_items);
+  switch (app->geom.cube_app.colors[index]) {
     case 0: *r = 1.0; *g = 0.0; *b = 0.0; break;
     case 1: *r = 0.1; *g = 0.8; *b = 0.0; break;
     case 2: *r = 0.1; *g = 0.4; *b = 1.0; break;
@@ -190,10 +544,11 @@ static void get_cube_color(struct app_contents app,
   }
 }
 
-static void get_cylinder_color(struct app_contents app,
+static void get_cylinder_color(const struct app_contents *app,
                                int index, float *r, float *g, float *b)
 {
-  switch (app.geom.cylinder_app.colors[index]) {
+  check_index("cylinder", index, app->geom.cylinder_app.num_items);
+  switch (app->geom.cylinder_app.colors[index]) {
     case 0: *r = 1.0; *g = 0.0; *b = 0.0; break;
     case 1: *r = 0.1; *g = 0.8; *b = 0.0; break;
     case 2: *r = 0.1; *g = 0.4; *b = 1.0; break;
@@ -202,41 +557,28 @@ static void get_cylinder_color(struct app_contents app,
 }
 
 static void change_colors(struct app_contents * app, int threshold) {
-  int i;
   switch (app->type)
   {
     case CUBE_GEOM:
-      for (i=0; i < NB_CUBES; i++)
-        if (bound_random(threshold) < 10)
-          app->geom.cube_app.colors[i] = bound_random(4);
+      recolor_random(app->geom.cube_app.colors,
+                     app->geom.cube_app.num_items, threshold);
       break;
 
     case CYLINDER_GEOM:
-      for (i=0; i < NB_CYLINDERS; i++)
-        if (bound_random(threshold) < 10)
-          app->geom.cylinder_app.colors[i] = bound_random(4);
+      recolor_random(app->geom.cylinder_app.colors,
+                     app->geom.cylinder_app.num_items, threshold);
       break;
   }
-
 }
 
 static void init_cylinder_circ_cache(struct app_contents *app) {
+  int segments = app->geom.cylinder_app.segments;
   int i;
-  for (i = 0; i < CIRC_SEGi; i++)
-  {
-    float a;
-    float x, y;
-    a = TWO_PI / CIRC_SEGf * ((float) i);
-    x = 1.1f * cosf(a);
-    y = 1.1f * sinf(a);
-    app->geom.cylinder_app.circ_cache[i][0] = x;
-    app->geom.cylinder_app.circ_cache[i][1] = y;
-  }
-  for (i = 0; i < CIRC_SEGi2; i++)
+  for (i = 0; i < segments; i++)
   {
     float a;
     float x, y;
-    a = TWO_PI / CIRC_SEGf2 * ((float) i);
+    a = TWO_PI / ((float) segments) * ((float) i);
     x = 1.3f * cosf(a);
     y = 1.3f * sinf(a);
     app->geom.cylinder_app.circ_cache2[i][0] = x;
@@ -244,6 +586,196 @@ static void init_cylinder_circ_cache(struct app_contents *app) {
   }
 }
 
+/* cube lattice, in the unscaled coordinates of the grid */
+static void init_cube_positions(struct app_contents *app) {
+  int side = app->geom.cube_app.side;
+  float step, half;
+  int i, j, k;
+  int index;
+
+  step = 0.8;
+  half = step * ((float)(side - 1)) / 2.0;
+
+  app->sort_valid = 0;
+
+  index = 0;
+  for (i=0; i < side; i++)
+    for (j=0; j < side; j++)
+      for (k=0; k < side; k++)
+      {
+        app->geom.cube_app.pos[0][index] = (((float)i) * step) - half;
+        app->geom.cube_app.pos[1][index] = (((float)j) * step) - half;
+        app->geom.cube_app.pos[2][index] = (((float)k) * step) - half;
+        index++;
+      }
+}
+
+/* rows of cylinders around the circle of circ_cache2 */
+static void init_cylinder_positions(struct app_contents *app) {
+  int rows = app->geom.cylinder_app.rows;
+  int i, zi;
+  int index;
+
+  app->sort_valid = 0;
+
+  index = 0;
+  for (i=0; i < app->geom.cylinder_app.segments; i++)
+    for (zi = 0; zi < rows; zi++) /* each rows */
+    {
+      app->geom.cylinder_app.pos[0][index] =
+        app->geom.cylinder_app.circ_cache2[i][0];
+      app->geom.cylinder_app.pos[1][index] =
+        app->geom.cylinder_app.circ_cache2[i][1];
+      app->geom.cylinder_app.pos[2][index] =
+        -1.0f + (zi * (2.0f / (rows - 1)));
+      index++;
+    }
+}
+
+static void layout_bsp(struct bsp_tree *bsp, struct scene_arena *arena, int n)
+{
+  bsp->nodes = arena_alloc(arena, 2 * (size_t) n, sizeof(struct bsp_node));
+  bsp->items = arena_alloc(arena, n, sizeof(int));
+  bsp->stack = arena_alloc(arena, (size_t) n + 1, sizeof(int));
+}
+
+static void layout_scene(struct app_contents *app, struct scene_arena *arena)
+{
+  int i;
+  if (app->type == CUBE_GEOM)
+  {
+    struct cube_geom *geom = &(app->geom.cube_app);
+    int n = geom->num_items;
+    geom->colors = arena_alloc(arena, n, sizeof(unsigned char));
+    geom->visibility = arena_alloc(arena, vis_words(n), sizeof(unsigned int));
+    for (i = 0; i < 3; i++) {
+      geom->pos[i] = arena_alloc(arena, n, sizeof(float));
+      geom->view_pos[i] = arena_alloc(arena, n, sizeof(float));
+    }
+    geom->rgb = arena_alloc(arena, 3 * (size_t) n, sizeof(float));
+    geom->keys = arena_alloc(arena, n, sizeof(struct sort_key));
+    geom->keys_tmp = arena_alloc(arena, n, sizeof(struct sort_key));
+    geom->axis_order = arena_alloc(arena, 3 * geom->side, sizeof(int));
+    layout_bsp(&(geom->bsp), arena, n);
+    geom->hidden = arena_alloc(arena, vis_words(n), sizeof(unsigned int));
+    geom->cover = arena_alloc(arena, COVER_GRID * COVER_GRID, 1);
+  }
+  if (app->type == CYLINDER_GEOM)
+  {
+    struct cylinder_geom *geom = &(app->geom.cylinder_app);
+    int n = geom->num_items;
+    geom->colors = arena_alloc(arena, n, sizeof(unsigned char));
+    geom->visibility = arena_alloc(arena, vis_words(n), sizeof(unsigned int));
+    geom->circ_cache2 = arena_alloc(arena, geom->segments, 2 * sizeof(float));
+    for (i = 0; i < 3; i++) {
+      geom->pos[i] = arena_alloc(arena, n, sizeof(float));
+      geom->view_pos[i] = arena_alloc(arena, n, sizeof(float));
+    }
+    geom->rgb = arena_alloc(arena, 3 * (size_t) n, sizeof(float));
+    geom->keys = arena_alloc(arena, n, sizeof(struct sort_key));
+    geom->keys_tmp = arena_alloc(arena, n, sizeof(struct sort_key));
+    layout_bsp(&(geom->bsp), arena, n);
+  }
+}
+
+/* init_app() keeps the options within MAX_ITEMS, this is the last check
+   before the buffers are sized from the count */
+static int scene_items(long long count)
+{
+  if (count < 1 || count > MAX_ITEMS) {
+    fprintf(stderr, "%s: scene too large\n", progname);
+    exit(1);
+  }
+  return (int) count;
+}
+
+/* (re)builds the scene of the current geometry type */
+static void init_scene(struct app_contents *app)
+{
+  struct scene_arena *arena = &(app->arena);
+
+  memset(&(app->geom), 0, sizeof(union geom_disp));
+  if (app->type == CUBE_GEOM)
+  {
+    struct cube_geom *geom = &(app->geom.cube_app);
+    geom->side = lattice_side;
+    geom->num_items = scene_items((long long) lattice_side *
+                                  lattice_side * lattice_side);
+  }
+  if (app->type == CYLINDER_GEOM)
+  {
+    struct cylinder_geom *geom = &(app->geom.cylinder_app);
+    geom->segments = cyl_segments;
+    geom->rows = cyl_rows;
+    geom->num_items = scene_items((long long) cyl_segments * cyl_rows);
+  }
+
+  app->frame_ready = False;
+  app->frame_order = NULL;
+
+  free_arena(arena);
+  layout_scene(app, arena);
+  arena->size = arena->used;
+  arena->used = 0;
+  arena->base = malloc(arena->size);
+  if (arena->base == NULL) {
+    fprintf(stderr, "%s: out of memory\n", progname);
+    exit(1);
+  }
+  layout_scene(app, arena);
+
+  if (app->type == CUBE_GEOM)
+  {
+    init_cubes_color(app);
+    init_cubes_visibility(app);
+    init_cube_positions(app);
+  }
+  if (app->type == CYLINDER_GEOM)
+  {
+    init_cylinders_color(app);
+    init_cylinder_visibility(app);
+    init_cylinder_circ_cache(app);
+    init_cylinder_positions(app);
+  }
+}
+
+static int clamp_option(const char *name, int value, int min, int max)
+{
+  if (value < min || value > max) {
+    int v = (value < min ? min : max);
+    fprintf(stderr, "%s: -%s must be between %d and %d, using %d\n",
+            progname, name, min, max, v);
+    return v;
+  }
+  return value;
+}
+
+static enum draw_order parse_draw_order(const char *str)
+{
+  if (str == NULL || !strcmp(str, "auto"))
+    return ORDER_AUTO;
+  if (!strcmp(str, "sort"))
+    return ORDER_SORT;
+  if (!strcmp(str, "lattice"))
+    return ORDER_LATTICE;
+  if (!strcmp(str, "bsp"))
+    return ORDER_BSP;
+
+  fprintf(stderr, "%s: unknown order '%s', using auto\n", progname, str);
+  return ORDER_AUTO;
+}
+
+static Bool parse_backend(const char *str)
+{
+  if (str == NULL || !strcmp(str, "gl"))
+    return False;
+  if (!strcmp(str, "soft"))
+    return True;
+
+  fprintf(stderr, "%s: unknown backend '%s', using gl\n", progname, str);
+  return False;
+}
+
 static struct app_contents * app_storage = NULL;
 
 static void init_app(ModeInfo *mi, struct app_contents *apps[])
@@ -253,6 +785,20 @@ static void init_app(ModeInfo *mi, struct app_contents *apps[])
     int num_screens;
     num_screens = MI_NUM_SCREENS(mi);
 
+    lattice_side = clamp_option("side", lattice_side, 1, MAX_SIDE);
+    cyl_segments = clamp_option("segments", cyl_segments, 3, MAX_SEGMENTS);
+    cyl_rows = clamp_option("rows", cyl_rows, 2, MAX_ROWS);
+    if ((long long) cyl_segments * cyl_rows > MAX_ITEMS) {
+      /* at least MAX_ITEMS / MAX_SEGMENTS rows, well above 2 */
+      int rows = MAX_ITEMS / cyl_segments;
+      fprintf(stderr, "%s: -segments %d with -rows %d makes more than %d "
+              "cylinders, using %d rows\n",
+              progname, cyl_segments, cyl_rows, MAX_ITEMS, rows);
+      cyl_rows = rows;
+    }
+    if (num_threads != 0)
+      num_threads = clamp_option("threads", num_threads, 1, MAX_THREADS);
+
     *apps = calloc(num_screens, sizeof(struct app_contents));
 
     if (*apps == NULL) {
@@ -273,23 +819,15 @@ static void init_app(ModeInfo *mi, struct app_contents *apps[])
     app->anglex = bound_random(90);
     app->angley = bound_random(90);
     app->draw_mode = bound_random(1);
+    app->order = parse_draw_order(order_str);
+    app->soft = parse_backend(backend_str);
 
     switch (bound_random(2)) {
       case 0: app->type = CUBE_GEOM; break;
       case 1: app->type = CYLINDER_GEOM; break;
     }
 
-    if (app->type == CUBE_GEOM)
-    {
-      init_cubes_color(app);
-      init_cubes_visibility(app);
-    }
-    if (app->type == CYLINDER_GEOM)
-    {
-      init_cylinders_color(app);
-      init_cylinder_visibility(app);
-      init_cylinder_circ_cache(app);
-    }
+    init_scene(app);
   }
 }
 
@@ -302,396 +840,2830 @@ static void gradient_toggle_step (struct app_contents * app) {
     app->draw_mode = !app->draw_mode;
 }
 
-static int z_compare(const void * _a, const void * _b)
+/* maps the bits of a float to an unsigned int with the same ordering */
+static inline unsigned int float_sort_bits(float f)
 {
-  struct cube_struct *a, *b;
-  a = (struct cube_struct *) _a;
-  b = (struct cube_struct *) _b;
-  /* sort along the Z axis, the direction of the look */
-  if (mat_get_z(a->mat) > mat_get_z(b->mat))
-    return 1;
-  else
-    return -1;
+  union { float f; unsigned int u; } v;
+  v.f = f;
+  return (v.u & 0x80000000u) ? ~v.u : (v.u | 0x80000000u);
 }
 
-void draw_solid_cube(float size);
-void draw_wire_cube(float size);
-void draw_wire_cylinder(struct app_contents app, float scale);
-void draw_solid_cylinder(struct app_contents app, float scale);
-
-static void main_display (struct app_contents app) {
-  float step;
-  float half;
-  float scale;
-  int i, j, k;
-  int index;
-
-  if (app.draw_mode)
-    glClearColor(0.24, 0.25, 0.26, 0.0);
-  else
-    glClearColor(0.38, 0.16, 0.0, 0.0);
-
-  glClear(GL_COLOR_BUFFER_BIT);
-  glLoadIdentity();
+static void make_sort_keys(const float *z, struct sort_key *keys, int n)
+{
+  int i;
+  for (i = 0; i < n; i++)
+  {
+    keys[i].key = float_sort_bits(z[i]);
+    keys[i].index = i;
+  }
+}
 
-  glTranslatef(0.0, 0.0, -4.0);
+/* LSD radix sort of the depth keys, in 4 passes of 8 bits, the passes
+   where all the keys have the same digit are skipped (the high bytes
+   of the z of a scene are mostly the same), returns the sorted array
+   which is either keys or tmp */
+static struct sort_key *
+radix_sort_keys(struct sort_key *keys, struct sort_key *tmp, int n)
+{
+  unsigned int hist[4][256];
+  struct sort_key *src, *dst, *swap;
+  int i, pass;
 
-  glRotatef(app.angley, 1.0, 0.0, 0.0);
-  glRotatef(app.anglex, 0.0, 1.0, 0.0);
+  if (n <= 1) return keys;
 
-  if (app.type == CUBE_GEOM)
+  memset(hist, 0, sizeof(hist));
+  for (i = 0; i < n; i++)
   {
-    scale = 3.0 / SIDE;
-    glScalef(scale, scale, scale);
-
-    step = 0.8;
-    half = step * ((float)(SIDE - 1)) / 2.0;
+    unsigned int k = keys[i].key;
+    hist[0][k & 0xff]++;
+    hist[1][(k >> 8) & 0xff]++;
+    hist[2][(k >> 16) & 0xff]++;
+    hist[3][k >> 24]++;
+  }
 
-    index = 0;
-    for (i=0; i < SIDE; i++)
-      for (j=0; j < SIDE; j++)
-        for (k=0; k < SIDE; k++)
-        {
-          struct cube_struct * cube;
-          float x, y, z;
-          int vis;
+  src = keys;
+  dst = tmp;
+  for (pass = 0; pass < 4; pass++)
+  {
+    unsigned int *h = hist[pass];
+    unsigned int sum = 0;
+    int shift = pass * 8;
 
-          cube = &(app.geom.cube_app.cubes[index]);
+    if (h[(src[0].key >> shift) & 0xff] == (unsigned int) n)
+      continue;
 
-          /* one color assigned per cube */
-          if (!app.draw_mode) {
-            get_cube_color(app, index,
-                &(cube->r),
-                &(cube->g),
-                &(cube->b) );
-          }
+    for (i = 0; i < 256; i++)
+    {
+      unsigned int c = h[i];
+      h[i] = sum;
+      sum += c;
+    }
+    for (i = 0; i < n; i++)
+      dst[h[(src[i].key >> shift) & 0xff]++] = src[i];
 
-          vis = get_cube_visibility(app, index);
-          cube->vis = vis;
+    swap = src; src = dst; dst = swap;
+  }
+  return src;
+}
 
-          x = (((float)i) * step) - half;
-          y = (((float)j) * step) - half;
-          z = (((float)k) * step) - half;
+/* repairs an almost sorted array of keys with an insertion sort, which
+   is linear when few keys are out of place, returns the number of
+   keys moved (the number of inversions), or -1 when it gave up after
+   max_moves, the keys are still a valid permutation in this case */
+static long insertion_sort_keys(struct sort_key *keys, int n, long max_moves)
+{
+  long moves = 0;
+  int i, j;
 
-          glPushMatrix();
-            glTranslatef(x, y, z);
-            glGetFloatv(GL_MODELVIEW_MATRIX, cube->mat);
-          glPopMatrix();
+  for (i = 1; i < n; i++)
+  {
+    struct sort_key k = keys[i];
+    for (j = i - 1; j >= 0 && keys[j].key > k.key; j--)
+      keys[j + 1] = keys[j];
+    keys[j + 1] = k;
+    moves += (i - 1) - j;
+    if (moves > max_moves)
+      return -1;
+  }
+  return moves;
+}
 
-          index++;
-        }
+/* {{{ thread pool */
+
+#ifdef HAVE_PTHREAD
+
+/* The caller of pool_run() runs the first part of the job and the
+   workers the others. The jobs of the screens are run one at a time. */
+struct thread_pool {
+  int num_workers;
+  pthread_t threads[MAX_THREADS - 1];
+  pthread_mutex_t job_lock;
+  pthread_mutex_t lock;
+  pthread_cond_t work;
+  pthread_cond_t done;
+  void (*job)(void *arg, int part, int num_parts);
+  void *arg;
+  int num_parts;
+  int pending;
+  unsigned long generation;
+  Bool quit;
+  Bool started;  /* even with no workers, the locks are set up */
+};
 
-    /* sort the items along the Z axis */
-    qsort(app.geom.cube_app.cubes, NB_CUBES,
-          sizeof(struct cube_struct), z_compare);
+static struct thread_pool pool;
 
-    /* make a vertical gradient with the cubes */
-    if (app.draw_mode)
-      for (i=0; i < NB_CUBES; i++)
-      {
-        float r;
-        float y, v;
-        struct cube_struct * cube;
-        cube = &(app.geom.cube_app.cubes[i]);
-        y = mat_get_y(cube->mat);
-        r = sqrt(half * half * 3.) * 0.5;
-        v = y + r;
-        v = v / r / 2.;
-        v = v * 1.4;
-        cube->r = v;
-        cube->b = 1.0 - v;
-        cube->g = 0.0;
-      }
+static void *pool_worker_main(void *arg)
+{
+  int part = 1 + (int) (long) arg;
+  unsigned long seen = 0;
 
-    /* finally do draw the cubes */
-    for (i=0; i < NB_CUBES; i++)
+  pthread_mutex_lock(&pool.lock);
+  for (;;)
+  {
+    while (pool.generation == seen && !pool.quit)
+      pthread_cond_wait(&pool.work, &pool.lock);
+    if (pool.quit)
+      break;
+    seen = pool.generation;
+    if (part < pool.num_parts)
     {
-      struct cube_struct * cube;
-      cube = &(app.geom.cube_app.cubes[i]);
-      if (cube->vis)
-      {
-        glLoadIdentity();
-        glMultMatrixf(cube->mat);
+      void (*job)(void *, int, int) = pool.job;
+      void *job_arg = pool.arg;
+      int num_parts = pool.num_parts;
 
-        glScalef(0.5, 0.5, 0.5);
-        glColor3f(0.0, 0.0, 0.0);
-        draw_solid_cube(1.0);
+      pthread_mutex_unlock(&pool.lock);
+      job(job_arg, part, num_parts);
+      pthread_mutex_lock(&pool.lock);
 
-        glColor3f(cube->r, cube->g, cube->b);
-        draw_solid_cube(0.89);
-        glColor3f(1.0, 1.0, 1.0);
-        draw_wire_cube(0.89);
-      }
+      if (--pool.pending == 0)
+        pthread_cond_broadcast(&pool.done);
     }
   }
+  pthread_mutex_unlock(&pool.lock);
+  return NULL;
+}
 
-  if (app.type == CYLINDER_GEOM)
-  {
-    int i;
+/* threads is the total count, 0 for one per processor */
+static void start_thread_pool(int threads)
+{
+  int i;
 
-    index = 0;
-    for (i=0; i < CIRC_SEGi2; i++)
-    {
-      struct cylinder_struct * cyld;
-      float x, y;
-      x = app.geom.cylinder_app.circ_cache2[i][0];
-      y = app.geom.cylinder_app.circ_cache2[i][1];
+  if (pool.started)
+    return;
 
-      { int zi; float z;
-        for (zi = 0; zi < CYL_ZN; zi++) /* each rows */
-        {
-          z = -1.0f + (zi * (2.0f / (CYL_ZN - 1)));
-
-          cyld = &(app.geom.cylinder_app.cylinders[index]);
-          if (!app.draw_mode) {
-            get_cylinder_color(app, index,
-                &(cyld->r),
-                &(cyld->g),
-                &(cyld->b) );
-          }
-
-          cyld->vis = get_cylinder_visibility(app, index);
-
-          glPushMatrix();
-            glTranslatef(x, y, z);
-            glGetFloatv(GL_MODELVIEW_MATRIX, cyld->mat);
-          glPopMatrix();
-          index++;
-        }
-      }
-    }
+  if (threads <= 0)
+  {
+#ifdef _SC_NPROCESSORS_ONLN
+    threads = sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+    if (threads <= 0)
+      threads = 1;
+  }
+  if (threads > MAX_THREADS)
+    threads = MAX_THREADS;
+
+  pthread_mutex_init(&pool.job_lock, NULL);
+  pthread_mutex_init(&pool.lock, NULL);
+  pthread_cond_init(&pool.work, NULL);
+  pthread_cond_init(&pool.done, NULL);
+  pool.quit = False;
+  /* the workers start at generation 0, a restarted pool must not see
+     the job of its last run */
+  pool.generation = 0;
+  pool.pending = 0;
+  pool.num_parts = 0;
+  pool.job = NULL;
+  pool.arg = NULL;
+
+  for (i = 0; i < threads - 1; i++)
+    if (pthread_create(&pool.threads[i], NULL, pool_worker_main,
+                       (void *) (long) i) != 0)
+      break;
+  pool.num_workers = i;
+  pool.started = True;
+}
 
-    /* sort the items along the Z axis */
-    qsort(app.geom.cylinder_app.cylinders, NB_CYLINDERS,
-          sizeof(struct cylinder_struct), z_compare);
+static void stop_thread_pool(void)
+{
+  int i;
 
-    /* make a vertical gradient */
-    if (app.draw_mode)
-      for (i=0; i < NB_CYLINDERS; i++)
-      {
-        float r;
-        float y, v;
-        struct cylinder_struct * cyld;
-        cyld = &(app.geom.cylinder_app.cylinders[i]);
-        y = mat_get_y(cyld->mat);
-        r = sqrt(half * half * 3.) * 0.5;
-        v = y + r;
-        v = v / r / 2.;
-        v = v * 1.4;
-        cyld->r = v;
-        cyld->b = 1.0 - v;
-        cyld->g = 0.0;
-      }
+  if (!pool.started)
+    return;
 
-    for (i=0; i < NB_CYLINDERS; i++)
-    {
-      struct cylinder_struct * cyld;
-      cyld = &(app.geom.cylinder_app.cylinders[i]);
-      if (cyld->vis)
-      {
-        glLoadIdentity();
-        glMultMatrixf(cyld->mat);
+  pthread_mutex_lock(&pool.lock);
+  pool.quit = True;
+  pthread_cond_broadcast(&pool.work);
+  pthread_mutex_unlock(&pool.lock);
 
-        glColor3f(0.0, 0.0, 0.0);             draw_solid_cylinder(app, 0.10);
-        glColor3f(cyld->r, cyld->g, cyld->b); draw_solid_cylinder(app, 0.09);
-        glColor3f(1.0, 1.0, 1.0);             draw_wire_cylinder(app,  0.09);
-      }
-    }
-  }
+  for (i = 0; i < pool.num_workers; i++)
+    pthread_join(pool.threads[i], NULL);
+  pool.num_workers = 0;
+
+  pthread_cond_destroy(&pool.done);
+  pthread_cond_destroy(&pool.work);
+  pthread_mutex_destroy(&pool.lock);
+  pthread_mutex_destroy(&pool.job_lock);
+  pool.started = False;
 }
 
-/* points for one cube */
-#define A() glVertex3f( - size, + size, - size )
-#define B() glVertex3f( + size, + size, - size )
-#define C() glVertex3f( + size, - size, - size )
-#define D() glVertex3f( - size, - size, - size )
-#define E() glVertex3f( - size, - size, + size )
-#define F() glVertex3f( + size, - size, + size )
-#define G() glVertex3f( + size, + size, + size )
-#define H() glVertex3f( - size, + size, + size )
-
-/* normals directions for each face */
-#define pos_x() glNormal3d( 1.0,  0.0,  0.0)
-#define neg_x() glNormal3d(-1.0,  0.0,  0.0)
-#define pos_y() glNormal3d( 0.0,  1.0,  0.0)
-#define neg_y() glNormal3d( 0.0, -1.0,  0.0)
-#define pos_z() glNormal3d( 0.0,  0.0,  1.0)
-#define neg_z() glNormal3d( 0.0,  0.0, -1.0)
-
-void draw_solid_cube(float _size)
-{
-  float size = _size * 0.5;
-  /* we dont need normals for this demo */
-#if 0
-  glBegin(GL_TRIANGLE_STRIP);
-    neg_z();    D(); A(); C(); B();
-    pos_x();    F(); G();
-    pos_z();    E(); H();
-    neg_x();    D(); A();
-  glEnd();
-
-  glBegin(GL_TRIANGLE_STRIP);
-    pos_y();    A(); H(); B(); G();
-  glEnd();
-
-  glBegin(GL_TRIANGLE_STRIP);
-    neg_y();    E(); D(); F(); C();
-  glEnd();
-#else
-  glBegin(GL_TRIANGLE_STRIP);
-    D(); A(); C(); B();
-    F(); G();
-    E(); H();
-    D(); A();
-  glEnd();
-
-  glBegin(GL_TRIANGLE_STRIP);
-    A(); H(); B(); G();
-  glEnd();
-
-  glBegin(GL_TRIANGLE_STRIP);
-    E(); D(); F(); C();
-  glEnd();
-#endif
+static int pool_threads(void)
+{
+  return pool.num_workers + 1;
 }
 
-void draw_wire_cube(float _size)
+static void pool_run(void (*job)(void *arg, int part, int num_parts),
+                     void *arg, int num_parts)
 {
-  float size = _size * 0.5f;
+  if (num_parts > pool.num_workers + 1)
+    num_parts = pool.num_workers + 1;
+  if (num_parts <= 1) {
+    job(arg, 0, 1);
+    return;
+  }
 
-  glBegin(GL_LINE_LOOP);
-    A(); B(); C(); D(); E(); F(); G(); H();
-  glEnd();
+  pthread_mutex_lock(&pool.job_lock);
 
-  glBegin(GL_LINES);
-    A(); D();
-    B(); G();
-    C(); F();
-    E(); H();
-  glEnd();
-}
+  pthread_mutex_lock(&pool.lock);
+  pool.job = job;
+  pool.arg = arg;
+  pool.num_parts = num_parts;
+  pool.pending = num_parts - 1;
+  pool.generation++;
+  pthread_cond_broadcast(&pool.work);
+  pthread_mutex_unlock(&pool.lock);
+
+  job(arg, 0, num_parts);
 
-#undef pos_x
-#undef neg_x
-#undef pos_y
-#undef neg_y
-#undef pos_z
-#undef neg_z
+  pthread_mutex_lock(&pool.lock);
+  while (pool.pending > 0)
+    pthread_cond_wait(&pool.done, &pool.lock);
+  pthread_mutex_unlock(&pool.lock);
+
+  pthread_mutex_unlock(&pool.job_lock);
+}
 
-#undef A
-#undef B
-#undef C
-#undef D
-#undef E
-#undef F
-#undef G
-#undef H
+#else /* !HAVE_PTHREAD */
 
+static void start_thread_pool(int threads) { }
+static void stop_thread_pool(void) { }
+static int pool_threads(void) { return 1; }
 
-void draw_wire_cylinder(struct app_contents app, float scale)
+static void pool_run(void (*job)(void *arg, int part, int num_parts),
+                     void *arg, int num_parts)
 {
-  glPushMatrix();
-  glScalef(scale, scale, scale);
-  { int i, alt;
-    glBegin(GL_LINE_LOOP);
-    for (i=0; i < CIRC_SEGi; i++)
-    {
-      float x, y;
-      x = app.geom.cylinder_app.circ_cache[i][0];
-      y = app.geom.cylinder_app.circ_cache[i][1];
-      glVertex3f( x, y, 1.0f );
-    }
-    glEnd();
+  job(arg, 0, 1);
+}
 
-    glBegin(GL_LINE_LOOP);
-    for (i=0; i < CIRC_SEGi; i++)
-    {
-      float x, y;
-      x = app.geom.cylinder_app.circ_cache[i][0];
-      y = app.geom.cylinder_app.circ_cache[i][1];
-      glVertex3f( x, y, -1.0f );
-    }
-    glEnd();
+#endif /* !HAVE_PTHREAD */
 
-    alt = 1;
-    glBegin(GL_LINES);
-    for (i=0; i < CIRC_SEGi; i++)
-    {
-      if (alt) {
-        float x, y;
-        x = app.geom.cylinder_app.circ_cache[i][0];
-        y = app.geom.cylinder_app.circ_cache[i][1];
-        glVertex3f( x, y, 1.0f );
-        glVertex3f( x, y, -1.0f );
-      }
-      alt = !alt;
-    }
-    glEnd();
-  }
-  glPopMatrix();
+/* how many parts for n items */
+static int pool_parts(int n)
+{
+  int parts = n / PAR_MIN_ITEMS;
+  if (parts > pool_threads())
+    parts = pool_threads();
+  return (parts < 1 ? 1 : parts);
 }
 
-void draw_solid_cylinder(struct app_contents app, float scale)
+/* the items of one part, a multiple of 4 but for the last one */
+static void part_range(int n, int part, int num_parts, int *lo, int *hi)
 {
-  glPushMatrix();
-  glScalef(scale, scale, scale);
-  { int i;
-    glBegin(GL_QUADS);
-    for (i=0; i < (CIRC_SEGi - 1); i++)
-    {
-      float x, y;
+  long chunk = ((long) n / num_parts + 3) & ~3L;
+  long a = chunk * part, b = a + chunk;
+  if (part == num_parts - 1 || b > n)
+    b = n;
+  if (a > n)
+    a = n;
+  *lo = a;
+  *hi = b;
+}
 
-      x = app.geom.cylinder_app.circ_cache[i][0];
-      y = app.geom.cylinder_app.circ_cache[i][1];
-      glVertex3f( x, y, 1.0f );
-      glVertex3f( x, y, -1.0f );
+/* }}} */
 
-      x = app.geom.cylinder_app.circ_cache[i+1][0];
-      y = app.geom.cylinder_app.circ_cache[i+1][1];
-      glVertex3f( x, y, -1.0f );
-      glVertex3f( x, y, 1.0f );
-    }
-    {
-      float x, y;
-
-      x = app.geom.cylinder_app.circ_cache[CIRC_SEGi-1][0];
-      y = app.geom.cylinder_app.circ_cache[CIRC_SEGi-1][1];
-      glVertex3f( x, y, 1.0f );
-      glVertex3f( x, y, -1.0f );
-
-      x = app.geom.cylinder_app.circ_cache[0][0];
-      y = app.geom.cylinder_app.circ_cache[0][1];
-      glVertex3f( x, y, -1.0f );
-      glVertex3f( x, y, 1.0f );
-    }
-    glEnd();
-
-    /*
-    glBegin(GL_TRIANGLE_FAN);
-      glVertex3f( 0.0f, 0.0f, 1.0f );
-    */
-    glBegin(GL_POLYGON);
-    for (i=0; i < CIRC_SEGi; i++)
-    {
-      float x, y;
-      x = app.geom.cylinder_app.circ_cache[i][0];
-      y = app.geom.cylinder_app.circ_cache[i][1];
-      glVertex3f( x, y, 1.0f );
-    }
-    glEnd();
+/* {{{ parallel frame preparation */
+
+static void transform_positions(const GLfloat *m,
+                                const float *px, const float *py,
+                                const float *pz,
+                                float *vx, float *vy, float *vz, int n);
+
+struct transform_job {
+  const GLfloat *m;
+  float **pos;
+  float **view_pos;
+  int n;
+};
+
+static void transform_part(void *arg, int part, int num_parts)
+{
+  struct transform_job *job = (struct transform_job *) arg;
+  int lo, hi;
+  part_range(job->n, part, num_parts, &lo, &hi);
+  transform_positions(job->m,
+      job->pos[0] + lo, job->pos[1] + lo, job->pos[2] + lo,
+      job->view_pos[0] + lo, job->view_pos[1] + lo, job->view_pos[2] + lo,
+      hi - lo);
+}
+
+static void parallel_transform(const GLfloat *m, float *pos[3],
+                               float *view_pos[3], int n, int num_parts)
+{
+  struct transform_job job;
+  job.m = m;
+  job.pos = pos;
+  job.view_pos = view_pos;
+  job.n = n;
+  pool_run(transform_part, &job, num_parts);
+}
+
+/* new keys in storage order, or new keys for the order of the
+   previous frame */
+struct keys_job {
+  const float *z;
+  struct sort_key *keys;
+  int n;
+  Bool reorder;
+};
+
+static void keys_part(void *arg, int part, int num_parts)
+{
+  struct keys_job *job = (struct keys_job *) arg;
+  struct sort_key *keys = job->keys;
+  int i, lo, hi;
+
+  part_range(job->n, part, num_parts, &lo, &hi);
+  if (job->reorder)
+    for (i = lo; i < hi; i++)
+      keys[i].key = float_sort_bits(job->z[keys[i].index]);
+  else
+    for (i = lo; i < hi; i++) {
+      keys[i].key = float_sort_bits(job->z[i]);
+      keys[i].index = i;
+    }
+}
+
+static void parallel_sort_keys(const float *z, struct sort_key *keys,
+                               int n, Bool reorder, int num_parts)
+{
+  struct keys_job job;
+  job.z = z;
+  job.keys = keys;
+  job.n = n;
+  job.reorder = reorder;
+  pool_run(keys_part, &job, num_parts);
+}
+
+/* each part counts the digits of its chunk, then scatters it from its
+   own offsets, which keeps each pass stable */
+struct radix_job {
+  struct sort_key *src, *dst;
+  int n;
+  int shift;
+  Bool scatter;
+  unsigned int hist[MAX_THREADS][256];
+};
+
+static void radix_part(void *arg, int part, int num_parts)
+{
+  struct radix_job *job = (struct radix_job *) arg;
+  unsigned int *h = job->hist[part];
+  const struct sort_key *src = job->src;
+  int shift = job->shift;
+  int i, lo, hi;
+
+  part_range(job->n, part, num_parts, &lo, &hi);
+  if (!job->scatter) {
+    memset(h, 0, 256 * sizeof(unsigned int));
+    for (i = lo; i < hi; i++)
+      h[(src[i].key >> shift) & 0xff]++;
+  } else {
+    struct sort_key *dst = job->dst;
+    for (i = lo; i < hi; i++)
+      dst[h[(src[i].key >> shift) & 0xff]++] = src[i];
+  }
+}
+
+/* the job (64 KB of histograms) is kept by the caller, the screens
+   sort at the same time on their frame workers */
+static struct radix_job *alloc_radix_job(void)
+{
+  struct radix_job *job = malloc(sizeof(struct radix_job));
+  if (job == NULL) {
+    fprintf(stderr, "%s: out of memory\n", progname);
+    exit(1);
+  }
+  return job;
+}
+
+static struct sort_key *
+parallel_radix_sort_keys(struct radix_job *job, struct sort_key *keys,
+                         struct sort_key *tmp, int n, int num_parts)
+{
+  struct sort_key *swap;
+  int pass;
+
+  if (num_parts > pool_threads())
+    num_parts = pool_threads();
+  if (num_parts <= 1)
+    return radix_sort_keys(keys, tmp, n);
+
+  job->src = keys;
+  job->dst = tmp;
+  job->n = n;
+  for (pass = 0; pass < 4; pass++)
+  {
+    unsigned int sum = 0;
+    int d, p;
+
+    job->shift = pass * 8;
+    job->scatter = False;
+    pool_run(radix_part, job, num_parts);
+
+    /* all the keys have the same digit */
+    d = (job->src[0].key >> job->shift) & 0xff;
+    for (p = 0; p < num_parts; p++)
+      sum += job->hist[p][d];
+    if (sum == (unsigned int) n)
+      continue;
+
+    sum = 0;
+    for (d = 0; d < 256; d++)
+      for (p = 0; p < num_parts; p++) {
+        unsigned int c = job->hist[p][d];
+        job->hist[p][d] = sum;
+        sum += c;
+      }
+
+    job->scatter = True;
+    pool_run(radix_part, job, num_parts);
+
+    swap = job->src; job->src = job->dst; job->dst = swap;
+  }
+
+  return job->src;
+}
+
+/* }}} */
+
+/* the rotation is slow, so the depth order barely changes from one
+   frame to the next, the order of the previous frame is kept in keys
+   and only repaired, with a full radix sort for the first frame or
+   when the order changed too much */
+static struct sort_key *
+coherent_sort(struct app_contents *app, const float *z,
+              struct sort_key *keys, struct sort_key *tmp, int n)
+{
+  struct sort_key *sorted;
+  long moves = -1;
+  int parts = pool_parts(n);
+
+  if (app->sort_valid)
+  {
+    parallel_sort_keys(z, keys, n, True, parts);
+    moves = insertion_sort_keys(keys, n, 4L * n + 64);
+  }
+  else
+    parallel_sort_keys(z, keys, n, False, parts);
+
+  if (moves >= 0)
+  {
+    app->stats.sort_moves += moves;
+    if (moves > app->stats.sort_max_moves)
+      app->stats.sort_max_moves = moves;
+    return keys;
+  }
+
+  if (parts > 1 && app->radix == NULL)
+    app->radix = alloc_radix_job();
+  sorted = parallel_radix_sort_keys(app->radix, keys, tmp, n, parts);
+  if (sorted != keys)
+    memcpy(keys, sorted, n * sizeof(struct sort_key));
+  app->sort_valid = 1;
+  app->stats.sort_full++;
+  return keys;
+}
+
+/* same as:
+     glTranslatef(0.0, 0.0, -4.0);
+     glRotatef(angley, 1.0, 0.0, 0.0);
+     glRotatef(anglex, 0.0, 1.0, 0.0);
+     glScalef(scale, scale, scale);
+   but without reading back the matrix from the driver */
+static void build_view_matrix(GLfloat *m, float anglex, float angley,
+                              float scale)
+{
+  float ax, ay;
+  float ca, sa, cb, sb;
+
+  ax = anglex * (M_PI / 180.0);
+  ay = angley * (M_PI / 180.0);
+  ca = cosf(ay); sa = sinf(ay);
+  cb = cosf(ax); sb = sinf(ax);
+
+  m[0] =  cb * scale;      m[4] = 0.0;         m[8]  =  sb * scale;
+  m[1] =  sa * sb * scale; m[5] = ca * scale;  m[9]  = -sa * cb * scale;
+  m[2] = -ca * sb * scale; m[6] = sa * scale;  m[10] =  ca * cb * scale;
+  m[3] = 0.0;              m[7] = 0.0;         m[11] = 0.0;
+
+  m[12] = 0.0;
+  m[13] = 0.0;
+  m[14] = -4.0;
+  m[15] = 1.0;
+}
+
+/* transforms a batch of positions by the matrix m (which has no
+   projective part), input and output are separated x, y, z arrays */
+static void transform_positions(const GLfloat *m,
+                                const float *px, const float *py,
+                                const float *pz,
+                                float *vx, float *vy, float *vz, int n)
+{
+  int i = 0;
+#ifdef __SSE__
+  {
+    __m128 m0 = _mm_set1_ps(m[0]), m4 = _mm_set1_ps(m[4]);
+    __m128 m8 = _mm_set1_ps(m[8]), m12 = _mm_set1_ps(m[12]);
+    __m128 m1 = _mm_set1_ps(m[1]), m5 = _mm_set1_ps(m[5]);
+    __m128 m9 = _mm_set1_ps(m[9]), m13 = _mm_set1_ps(m[13]);
+    __m128 m2 = _mm_set1_ps(m[2]), m6 = _mm_set1_ps(m[6]);
+    __m128 m10 = _mm_set1_ps(m[10]), m14 = _mm_set1_ps(m[14]);
+
+    for (; i + 4 <= n; i += 4)
+    {
+      __m128 x = _mm_loadu_ps(px + i);
+      __m128 y = _mm_loadu_ps(py + i);
+      __m128 z = _mm_loadu_ps(pz + i);
+      __m128 r;
+
+      r = _mm_add_ps(_mm_add_ps(_mm_mul_ps(m0, x), _mm_mul_ps(m4, y)),
+                     _mm_add_ps(_mm_mul_ps(m8, z), m12));
+      _mm_storeu_ps(vx + i, r);
+
+      r = _mm_add_ps(_mm_add_ps(_mm_mul_ps(m1, x), _mm_mul_ps(m5, y)),
+                     _mm_add_ps(_mm_mul_ps(m9, z), m13));
+      _mm_storeu_ps(vy + i, r);
+
+      r = _mm_add_ps(_mm_add_ps(_mm_mul_ps(m2, x), _mm_mul_ps(m6, y)),
+                     _mm_add_ps(_mm_mul_ps(m10, z), m14));
+      _mm_storeu_ps(vz + i, r);
+    }
+  }
+#endif
+  for (; i < n; i++)
+  {
+    float x = px[i], y = py[i], z = pz[i];
+    vx[i] = m[0] * x + m[4] * y + m[8]  * z + m[12];
+    vy[i] = m[1] * x + m[5] * y + m[9]  * z + m[13];
+    vz[i] = m[2] * x + m[6] * y + m[10] * z + m[14];
+  }
+}
+
+/* the modelview of one item, only uploaded to draw it */
+static void load_item_matrix(const GLfloat *view, float x, float y, float z)
+{
+  GLfloat mat[16];
+  memcpy(mat, view, 12 * sizeof(GLfloat));
+  mat[12] = x;
+  mat[13] = y;
+  mat[14] = z;
+  mat[15] = 1.0;
+  glLoadMatrixf(mat);
+}
+
+/* position of the eye (the origin of view space) in the coordinates
+   of the items, the view matrix is a rotation and a uniform scale */
+static void view_eye_position(const GLfloat *m, float *eye)
+{
+  float s2 = m[0] * m[0] + m[1] * m[1] + m[2] * m[2];
+  eye[0] = -(m[0] * m[12] + m[1] * m[13] + m[2]  * m[14]) / s2;
+  eye[1] = -(m[4] * m[12] + m[5] * m[13] + m[6]  * m[14]) / s2;
+  eye[2] = -(m[8] * m[12] + m[9] * m[13] + m[10] * m[14]) / s2;
+}
+
+/* the cells of one axis from the farthest to the nearest of the eye,
+   coming from both ends when the eye is between them */
+static void lattice_axis_order(int side, float step, float half,
+                               float eye, int *out)
+{
+  int lo = 0, hi = side - 1;
+  int n = 0;
+  while (lo <= hi)
+  {
+    float d_lo = fabsf((lo * step - half) - eye);
+    float d_hi = fabsf((hi * step - half) - eye);
+    if (d_lo >= d_hi)
+      out[n++] = lo++;
+    else
+      out[n++] = hi--;
+  }
+}
+
+/* painter's order of a regular lattice without sorting: when a cube
+   hides another one, along every axis the hidden one is at least as
+   far from the eye, so nesting the loops of the three axes, each one
+   going from its far end to its near end, draws it first */
+static struct sort_key *
+lattice_order(const GLfloat *view, int side, float step,
+              int *axis_order, struct sort_key *out)
+{
+  int *ord[3];
+  float eye[3];
+  float half;
+  int i, j, k, n;
+
+  half = step * ((float)(side - 1)) / 2.0;
+  view_eye_position(view, eye);
+
+  for (i = 0; i < 3; i++) {
+    ord[i] = axis_order + i * side;
+    lattice_axis_order(side, step, half, eye[i], ord[i]);
+  }
+
+  n = 0;
+  for (i=0; i < side; i++)
+    for (j=0; j < side; j++)
+    {
+      int base = (ord[0][i] * side + ord[1][j]) * side;
+      for (k=0; k < side; k++)
+        out[n++].index = base + ord[2][k];
+    }
+  return out;
+}
+
+/* {{{ bsp tree */
+
+/* The items never move, so a BSP tree over them is built once. The
+   planes are axis aligned and put in a gap between the items, as near
+   as possible of the median, so that no item is split. An item can only
+   hide the items on the other side of a plane than the eye, traversing
+   the far side of each node first gives the painter's order in O(n),
+   for any layout and for elongated items as well. */
+
+struct bsp_build {
+  struct bsp_tree *tree;
+  float *pos[3];
+  const float *extent;  /* half size of an item along each axis */
+  int *sorted[3];       /* item indices sorted along each axis */
+  int *tmp;
+  unsigned char *above;
+};
+
+/* the gap nearest of the middle of the range, or -1 */
+static int bsp_find_gap(const struct bsp_build *b, int axis,
+                        int first, int count)
+{
+  const int *s = b->sorted[axis] + first;
+  const float *c = b->pos[axis];
+  float gap = 2.0 * b->extent[axis];
+  int mid = count / 2;
+  int d;
+
+  for (d = 0; d <= mid; d++)
+  {
+    int k = mid - d;
+    if (k >= 1 && c[s[k]] - c[s[k - 1]] >= gap)
+      return k;
+    k = mid + d;
+    if (k < count && c[s[k]] - c[s[k - 1]] >= gap)
+      return k;
+  }
+  return -1;
+}
+
+/* keeps the other sorted lists sorted and split as the one of axis */
+static void bsp_partition(struct bsp_build *b, int axis, int first,
+                          int count, int k)
+{
+  int a, i;
+
+  for (i = 0; i < count; i++)
+    b->above[b->sorted[axis][first + i]] = (i >= k);
+
+  for (a = 0; a < 3; a++)
+  {
+    int *s = b->sorted[a] + first;
+    int lo = 0, hi = 0;
+    if (a == axis)
+      continue;
+    for (i = 0; i < count; i++) {
+      if (b->above[s[i]])
+        b->tmp[hi++] = s[i];
+      else
+        s[lo++] = s[i];
+    }
+    memcpy(s + lo, b->tmp, hi * sizeof(int));
+  }
+}
+
+static int bsp_build_node(struct bsp_build *b, int first, int count)
+{
+  struct bsp_tree *tree = b->tree;
+  int node = tree->num_nodes++;
+  int best_axis = -1, best_k = 0;
+  int axis;
+
+  for (axis = 0; count > 1 && axis < 3; axis++)
+  {
+    int k = bsp_find_gap(b, axis, first, count);
+    if (k >= 0 && (best_axis < 0 ||
+                   abs(k - count / 2) < abs(best_k - count / 2))) {
+      best_axis = axis;
+      best_k = k;
+    }
+  }
+
+  if (best_axis < 0)
+  {
+    struct bsp_node *leaf = &(tree->nodes[node]);
+    leaf->axis = -1;
+    leaf->first = first;
+    leaf->count = count;
+    memcpy(tree->items + first, b->sorted[0] + first, count * sizeof(int));
+  }
+  else
+  {
+    const int *s = b->sorted[best_axis] + first;
+    const float *c = b->pos[best_axis];
+    float split = (c[s[best_k - 1]] + c[s[best_k]]) / 2.0;
+    int below, above;
+
+    bsp_partition(b, best_axis, first, count, best_k);
+    below = bsp_build_node(b, first, best_k);
+    above = bsp_build_node(b, first + best_k, count - best_k);
+
+    tree->nodes[node].axis = best_axis;
+    tree->nodes[node].split = split;
+    tree->nodes[node].child[0] = below;
+    tree->nodes[node].child[1] = above;
+  }
+  return node;
+}
+
+static void build_bsp(struct bsp_tree *tree, float *pos[3],
+                      const float *extent, int n)
+{
+  struct bsp_build b;
+  struct sort_key *keys, *keys_tmp;
+  int a, i;
+
+  tree->num_nodes = 0;
+  tree->built = True;
+  if (n == 0)
+    return;
+
+  b.tree = tree;
+  b.extent = extent;
+  b.tmp = malloc(n * sizeof(int));
+  b.above = malloc(n);
+  /* the screens can rebuild their trees at the same time on the frame
+     workers, so the sort keeps no state outside of its arguments */
+  keys = malloc(n * sizeof(struct sort_key));
+  keys_tmp = malloc(n * sizeof(struct sort_key));
+  if (b.tmp == NULL || b.above == NULL || keys == NULL || keys_tmp == NULL) {
+    fprintf(stderr, "%s: out of memory\n", progname);
+    exit(1);
+  }
+
+  for (a = 0; a < 3; a++)
+  {
+    struct sort_key *sorted;
+    b.pos[a] = pos[a];
+    b.sorted[a] = malloc(n * sizeof(int));
+    if (b.sorted[a] == NULL) {
+      fprintf(stderr, "%s: out of memory\n", progname);
+      exit(1);
+    }
+    make_sort_keys(pos[a], keys, n);
+    sorted = radix_sort_keys(keys, keys_tmp, n);
+    for (i = 0; i < n; i++)
+      b.sorted[a][i] = sorted[i].index;
+  }
+  free(keys);
+  free(keys_tmp);
+
+  bsp_build_node(&b, 0, n);
+
+  for (a = 0; a < 3; a++)
+    free(b.sorted[a]);
+  free(b.tmp);
+  free(b.above);
+}
+
+/* back to front from the eye, the items of a leaf
+   which overlap each other are sorted by depth */
+static struct sort_key *
+bsp_order(const GLfloat *view, const struct bsp_tree *tree,
+          const float *view_z, struct sort_key *out, struct sort_key *tmp)
+{
+  float eye[3];
+  int sp = 0, n = 0;
+
+  if (tree->num_nodes == 0)
+    return out;
+
+  view_eye_position(view, eye);
+
+  tree->stack[sp++] = 0;
+  while (sp > 0)
+  {
+    const struct bsp_node *node = &(tree->nodes[tree->stack[--sp]]);
+
+    if (node->axis < 0)
+    {
+      int i;
+      for (i = 0; i < node->count; i++) {
+        int index = tree->items[node->first + i];
+        out[n + i].index = index;
+        out[n + i].key = float_sort_bits(view_z[index]);
+      }
+      if (node->count > 1 && node->count <= 32)
+        insertion_sort_keys(out + n, node->count, LONG_MAX);
+      else if (node->count > 32) {
+        struct sort_key *sorted = radix_sort_keys(out + n, tmp, node->count);
+        if (sorted != out + n)
+          memcpy(out + n, sorted, node->count * sizeof(struct sort_key));
+      }
+      n += node->count;
+      continue;
+    }
+
+    /* the near side is pushed first, so drawn last */
+    if (eye[node->axis] >= node->split) {
+      tree->stack[sp++] = node->child[1];
+      tree->stack[sp++] = node->child[0];
+    } else {
+      tree->stack[sp++] = node->child[0];
+      tree->stack[sp++] = node->child[1];
+    }
+  }
+  return out;
+}
+
+/* }}} */
+
+/* {{{ occlusion culling */
+
+/* The cubes are opaque and drawn in a valid painter's order, so going
+   through this order backwards, from the nearest cube, a cube is hidden
+   when the cubes before it already cover all its projection. The
+   coverage is kept in a grid over the viewport in normalized device
+   coordinates. It is conservative both ways: a cube only marks the
+   cells fully inside its silhouette, and a cube is only skipped when
+   all the cells touched by the bounding box of its silhouette are
+   marked. The cubes out of the viewport are skipped as well. */
+
+/* the silhouette of a cube is the convex hull of its 8 projected
+   corners, sorted counterclockwise in place, returns the hull size,
+   n is at most HULL_MAX_POINTS */
+static int convex_hull(float (*pt)[2], int n)
+{
+  float hull[HULL_MAX_POINTS + 1][2];
+  int i, j, k = 0;
+
+  /* insertion sort on x, then y */
+  for (i = 1; i < n; i++)
+  {
+    float px = pt[i][0], py = pt[i][1];
+    for (j = i; j > 0 && (pt[j - 1][0] > px ||
+                          (pt[j - 1][0] == px && pt[j - 1][1] > py)); j--)
+    {
+      pt[j][0] = pt[j - 1][0];
+      pt[j][1] = pt[j - 1][1];
+    }
+    pt[j][0] = px;
+    pt[j][1] = py;
+  }
+
+  /* monotone chain, lower then upper hull */
+#define CROSS(o, a, b) (((a)[0] - (o)[0]) * ((b)[1] - (o)[1]) - \
+                        ((a)[1] - (o)[1]) * ((b)[0] - (o)[0]))
+  for (i = 0; i < n; i++)
+  {
+    while (k >= 2 && CROSS(hull[k - 2], hull[k - 1], pt[i]) <= 0)
+      k--;
+    hull[k][0] = pt[i][0]; hull[k][1] = pt[i][1]; k++;
+  }
+  for (i = n - 2, j = k + 1; i >= 0; i--)
+  {
+    while (k >= j && CROSS(hull[k - 2], hull[k - 1], pt[i]) <= 0)
+      k--;
+    hull[k][0] = pt[i][0]; hull[k][1] = pt[i][1]; k++;
+  }
+#undef CROSS
+
+  k--;
+  memcpy(pt, hull, k * sizeof(hull[0]));
+  return k;
+}
+
+/* the horizontal extent of a convex polygon at height y */
+static int hull_span(float (*hull)[2], int n, float y, float *x0, float *x1)
+{
+  int i, found = 0;
+
+  *x0 = 1e30;
+  *x1 = -1e30;
+  for (i = 0; i < n; i++)
+  {
+    const float *a = hull[i], *b = hull[(i + 1) % n];
+    float x;
+    if ((a[1] > y) == (b[1] > y))
+      continue;
+    x = a[0] + (y - a[1]) * (b[0] - a[0]) / (b[1] - a[1]);
+    *x0 = fminf(*x0, x);
+    *x1 = fmaxf(*x1, x);
+    found = 1;
+  }
+  return found;
+}
+
+/* marks the cells fully inside the convex polygon, along a band of
+   cells the left border of the polygon is convex and the right one
+   concave, so their inner bounds are at the top or bottom of the band */
+static void cover_hull(unsigned char *cover, float (*hull)[2], int n,
+                       float ymin, float ymax)
+{
+  float cell = 2.0 / COVER_GRID;
+  int row, y0, y1;
+
+  y0 = (int) ceilf((ymin + 1.0) / cell);
+  y1 = (int) floorf((ymax + 1.0) / cell) - 1;
+  if (y0 < 0) y0 = 0;
+  if (y1 > COVER_GRID - 1) y1 = COVER_GRID - 1;
+
+  for (row = y0; row <= y1; row++)
+  {
+    float ylo = row * cell - 1.0, yhi = ylo + cell;
+    float l0, r0, l1, r1;
+    int x0, x1;
+
+    if (!hull_span(hull, n, ylo, &l0, &r0) ||
+        !hull_span(hull, n, yhi, &l1, &r1))
+      continue;
+    x0 = (int) ceilf((fmaxf(l0, l1) + 1.0) / cell);
+    x1 = (int) floorf((fminf(r0, r1) + 1.0) / cell) - 1;
+    if (x0 < 0) x0 = 0;
+    if (x1 > COVER_GRID - 1) x1 = COVER_GRID - 1;
+    if (x0 <= x1)
+      memset(cover + row * COVER_GRID + x0, 1, x1 - x0 + 1);
+  }
+}
+
+static int covered_rect(const unsigned char *cover,
+                        float xmin, float ymin, float xmax, float ymax)
+{
+  float cell = 2.0 / COVER_GRID;
+  int x0, x1, y0, y1, x, y;
+
+  /* out of the viewport */
+  if (xmax < -1.0 || xmin > 1.0 || ymax < -1.0 || ymin > 1.0)
+    return 1;
+
+  x0 = (int) floorf((xmin + 1.0) / cell);
+  x1 = (int) floorf((xmax + 1.0) / cell);
+  y0 = (int) floorf((ymin + 1.0) / cell);
+  y1 = (int) floorf((ymax + 1.0) / cell);
+  if (x0 < 0) x0 = 0;
+  if (y0 < 0) y0 = 0;
+  if (x1 > COVER_GRID - 1) x1 = COVER_GRID - 1;
+  if (y1 > COVER_GRID - 1) y1 = COVER_GRID - 1;
+
+  for (y = y0; y <= y1; y++)
+    for (x = x0; x <= x1; x++)
+      if (!cover[y * COVER_GRID + x])
+        return 0;
+  return 1;
+}
+
+static void occlusion_cull(struct app_contents *app, float half_size)
+{
+  struct cube_geom *geom = &(app->geom.cube_app);
+  const struct sort_key *order = app->frame_order;
+  const GLfloat *m = app->view;
+  float f = 1.0 / tan(VIEW_FOVY / 2.0 * M_PI / 180.0);
+  float corner[8][3];
+  float r, near = -1e30;
+  int i, c;
+
+  geom->culled = False;
+  geom->num_hidden = 0;
+
+  /* offsets of the corners in view space, the view matrix holds the
+     scale, so r is the half side of a cube in view space */
+  for (c = 0; c < 8; c++)
+  {
+    float sx = (c & 1) ? half_size : -half_size;
+    float sy = (c & 2) ? half_size : -half_size;
+    float sz = (c & 4) ? half_size : -half_size;
+    corner[c][0] = m[0] * sx + m[4] * sy + m[8]  * sz;
+    corner[c][1] = m[1] * sx + m[5] * sy + m[9]  * sz;
+    corner[c][2] = m[2] * sx + m[6] * sy + m[10] * sz;
+  }
+  r = half_size * sqrtf(m[0] * m[0] + m[1] * m[1] + m[2] * m[2]);
+
+  /* with many cubes, even the nearest one spans only a few cells and
+     marks next to nothing, do not spend the frame on it */
+  for (i = 0; i < geom->num_items; i++)
+    near = fmaxf(near, geom->view_pos[2][i]);
+  if (near + r * 1.8 < 0.0 &&
+      2.0 * 1.8 * r * f / -(near + r * 1.8) < 4 * 2.0 / COVER_GRID)
+    return;
+
+  memset(geom->cover, 0, COVER_GRID * COVER_GRID);
+  memset(geom->hidden, 0, vis_words(geom->num_items) * sizeof(unsigned int));
+
+  for (i = geom->num_items - 1; i >= 0; i--)
+  {
+    int index = order[i].index;
+    float x = geom->view_pos[0][index];
+    float y = geom->view_pos[1][index];
+    float z = geom->view_pos[2][index];
+    float xmin = 1e30, ymin = 1e30, xmax = -1e30, ymax = -1e30;
+    float proj[8][2];
+
+    if (!get_cube_visibility(app, index))
+      continue;
+
+    /* crossing the near plane, keep it (the corners are at most
+       sqrt(3) r away from the center) */
+    if (z + r * 1.8 > -0.5)
+      continue;
+
+    for (c = 0; c < 8; c++)
+    {
+      float w = -(z + corner[c][2]);
+      float px = f * (x + corner[c][0]) / w;
+      float py = f * (y + corner[c][1]) / w;
+      proj[c][0] = px;
+      proj[c][1] = py;
+      xmin = fminf(xmin, px); xmax = fmaxf(xmax, px);
+      ymin = fminf(ymin, py); ymax = fmaxf(ymax, py);
+    }
+
+    if (covered_rect(geom->cover, xmin, ymin, xmax, ymax)) {
+      set_vis_bit(geom->hidden, index, 1);
+      geom->num_hidden++;
+      continue;
+    }
+
+    if (xmax - xmin > 2.0 / COVER_GRID && ymax - ymin > 2.0 / COVER_GRID)
+      cover_hull(geom->cover, proj, convex_hull(proj, 8), ymin, ymax);
+  }
+
+  geom->culled = True;
+  app->stats.occluded += geom->num_hidden;
+}
+
+/* }}} */
+
+/* {{{ item meshes */
+
+/* each primitive is baked once in a vertex array holding the outer
+   solid (the black border), the inner solid and the inner wireframe,
+   an item is then drawn with three glDrawElements() calls, the
+   triangles are all counter-clockwise seen from the outside */
+
+struct item_mesh {
+  GLfloat *verts;
+  int num_verts;
+  GLushort *indices;
+  int num_indices;
+  int outer_first, outer_count;
+  int closed_count;      /* the outer solid with its bottom */
+  int inner_first, inner_count;
+  int lines_first, lines_count;
+  /* half size of the inner cube, or radius and
+     half height of the inner cylinder */
+  GLfloat inner_extent[2];
+};
+
+static struct item_mesh item_meshes[NB_MESHES];
+
+static void alloc_item_mesh(struct item_mesh *mesh,
+                            int num_verts, int num_indices)
+{
+  mesh->verts = malloc(num_verts * 3 * sizeof(GLfloat));
+  mesh->indices = malloc(num_indices * sizeof(GLushort));
+  if (mesh->verts == NULL || mesh->indices == NULL) {
+    fprintf(stderr, "%s: out of memory\n", progname);
+    exit(1);
+  }
+  mesh->num_verts = num_verts;
+  mesh->num_indices = 0;
+}
+
+static void mesh_vertex(struct item_mesh *mesh, int i,
+                        float x, float y, float z)
+{
+  mesh->verts[i * 3 + 0] = x;
+  mesh->verts[i * 3 + 1] = y;
+  mesh->verts[i * 3 + 2] = z;
+}
+
+static void mesh_tri(struct item_mesh *mesh, int a, int b, int c)
+{
+  mesh->indices[mesh->num_indices++] = a;
+  mesh->indices[mesh->num_indices++] = b;
+  mesh->indices[mesh->num_indices++] = c;
+}
+
+static void mesh_line(struct item_mesh *mesh, int a, int b)
+{
+  mesh->indices[mesh->num_indices++] = a;
+  mesh->indices[mesh->num_indices++] = b;
+}
+
+/* points for one cube */
+enum { A, B, C, D, E, F, G, H };
+
+static void cube_corners(struct item_mesh *mesh, int base, float size)
+{
+  mesh_vertex(mesh, base + A, - size, + size, - size);
+  mesh_vertex(mesh, base + B, + size, + size, - size);
+  mesh_vertex(mesh, base + C, + size, - size, - size);
+  mesh_vertex(mesh, base + D, - size, - size, - size);
+  mesh_vertex(mesh, base + E, - size, - size, + size);
+  mesh_vertex(mesh, base + F, + size, - size, + size);
+  mesh_vertex(mesh, base + G, + size, + size, + size);
+  mesh_vertex(mesh, base + H, - size, + size, + size);
+}
+
+static void cube_faces(struct item_mesh *mesh, int o)
+{
+  mesh_tri(mesh, o+A, o+B, o+C);  mesh_tri(mesh, o+A, o+C, o+D);  /* -z */
+  mesh_tri(mesh, o+E, o+F, o+G);  mesh_tri(mesh, o+E, o+G, o+H);  /* +z */
+  mesh_tri(mesh, o+C, o+B, o+G);  mesh_tri(mesh, o+C, o+G, o+F);  /* +x */
+  mesh_tri(mesh, o+A, o+D, o+E);  mesh_tri(mesh, o+A, o+E, o+H);  /* -x */
+  mesh_tri(mesh, o+A, o+H, o+G);  mesh_tri(mesh, o+A, o+G, o+B);  /* +y */
+  mesh_tri(mesh, o+D, o+C, o+F);  mesh_tri(mesh, o+D, o+F, o+E);  /* -y */
+}
+
+/* the cubes are drawn scaled by 0.5, with a border of size 1.0
+   and an inner cube of size 0.89 */
+static void make_cube_mesh(struct item_mesh *mesh)
+{
+  int o;
+  alloc_item_mesh(mesh, 16, 36 * 2 + 24);
+
+  cube_corners(mesh, 0, 0.5 * 1.0 * 0.5);
+  cube_corners(mesh, 8, 0.5 * 0.89 * 0.5);
+  mesh->inner_extent[0] = 0.5 * 0.89 * 0.5;
+  mesh->inner_extent[1] = 0.5 * 0.89 * 0.5;
+
+  mesh->outer_first = mesh->num_indices;
+  cube_faces(mesh, 0);
+  mesh->outer_count = mesh->num_indices - mesh->outer_first;
+  mesh->closed_count = mesh->outer_count;
+
+  mesh->inner_first = mesh->num_indices;
+  cube_faces(mesh, 8);
+  mesh->inner_count = mesh->num_indices - mesh->inner_first;
+
+  o = 8;
+  mesh->lines_first = mesh->num_indices;
+  mesh_line(mesh, o+A, o+B);  mesh_line(mesh, o+B, o+C);
+  mesh_line(mesh, o+C, o+D);  mesh_line(mesh, o+D, o+E);
+  mesh_line(mesh, o+E, o+F);  mesh_line(mesh, o+F, o+G);
+  mesh_line(mesh, o+G, o+H);  mesh_line(mesh, o+H, o+A);
+  mesh_line(mesh, o+A, o+D);  mesh_line(mesh, o+B, o+G);
+  mesh_line(mesh, o+C, o+F);  mesh_line(mesh, o+E, o+H);
+  mesh->lines_count = mesh->num_indices - mesh->lines_first;
+}
+
+/* top ring at base + 2*i, bottom ring at base + 2*i + 1 */
+static void cylinder_rings(struct item_mesh *mesh, int base, float scale,
+                           int segs)
+{
+  int i;
+  for (i = 0; i < segs; i++)
+  {
+    float a = TWO_PI / segs * ((float) i);
+    float x = 1.1f * cosf(a) * scale;
+    float y = 1.1f * sinf(a) * scale;
+    mesh_vertex(mesh, base + 2 * i,     x, y,  scale);
+    mesh_vertex(mesh, base + 2 * i + 1, x, y, -scale);
+  }
+}
+
+/* the side and the top cap, the bottom is left open */
+static void cylinder_faces(struct item_mesh *mesh, int base, int segs)
+{
+  int i;
+  for (i = 0; i < segs; i++)
+  {
+    int j = (i + 1) % segs;
+    int ti = base + 2 * i, bi = ti + 1;
+    int tj = base + 2 * j, bj = tj + 1;
+    mesh_tri(mesh, bi, bj, tj);
+    mesh_tri(mesh, bi, tj, ti);
+  }
+  for (i = 1; i < segs - 1; i++)
+    mesh_tri(mesh, base, base + 2 * i, base + 2 * (i + 1));
+}
+
+/* the cylinders have a border of scale 0.10 and an inner
+   cylinder of scale 0.09, around segs segments */
+static void make_cylinder_mesh(struct item_mesh *mesh, int segs)
+{
+  int i;
+  int side_tris = segs * 2 + (segs - 2);
+  int lines = segs * 2 + (segs + 1) / 2;
+
+  alloc_item_mesh(mesh, segs * 4,
+                  side_tris * 3 * 2 + (segs - 2) * 3 + lines * 2);
+
+  cylinder_rings(mesh, 0, 0.10, segs);
+  cylinder_rings(mesh, segs * 2, 0.09, segs);
+  mesh->inner_extent[0] = 1.1 * 0.09;
+  mesh->inner_extent[1] = 0.09;
+
+  mesh->outer_first = mesh->num_indices;
+  cylinder_faces(mesh, 0, segs);
+  mesh->outer_count = mesh->num_indices - mesh->outer_first;
+
+  /* the bottom cap of the border follows, only drawn with the depth
+     buffer, where its back faces must cover all the item */
+  for (i = 1; i < segs - 1; i++)
+    mesh_tri(mesh, 1, 2 * (i + 1) + 1, 2 * i + 1);
+  mesh->closed_count = mesh->num_indices - mesh->outer_first;
+
+  mesh->inner_first = mesh->num_indices;
+  cylinder_faces(mesh, segs * 2, segs);
+  mesh->inner_count = mesh->num_indices - mesh->inner_first;
+
+  mesh->lines_first = mesh->num_indices;
+  for (i = 0; i < segs; i++)
+  {
+    int j = (i + 1) % segs;
+    int ti = segs * 2 + 2 * i;
+    int tj = segs * 2 + 2 * j;
+    mesh_line(mesh, ti, tj);            /* top circle */
+    mesh_line(mesh, ti + 1, tj + 1);    /* bottom circle */
+    if (i % 2 == 0)
+      mesh_line(mesh, ti, ti + 1);      /* one side line out of two */
+  }
+  mesh->lines_count = mesh->num_indices - mesh->lines_first;
+}
+
+/* the largest radius on screen, in pixels, drawn with each level of
+   detail: the sagitta of a segment, r (1 - cos(pi / segs)), stays
+   under half a pixel */
+static float lod_max_radius[NB_CYLINDER_LODS];
+
+static void init_item_meshes(void)
+{
+  int l;
+  if (item_meshes[CUBE_MESH].verts != NULL)
+    return;
+  make_cube_mesh(&item_meshes[CUBE_MESH]);
+  for (l = 0; l < NB_CYLINDER_LODS; l++)
+  {
+    int segs = cylinder_lod_segments[l];
+    make_cylinder_mesh(&item_meshes[CYLINDER_MESH + l], segs);
+    lod_max_radius[l] = 0.5 / (1.0 - cos(M_PI / segs));
+  }
+}
+
+/* buffer objects are core since OpenGL 1.5, with an older
+   implementation the arrays are used from client memory */
+static int gl_version_at_least(int major, int minor)
+{
+  const char *version = (const char *) glGetString(GL_VERSION);
+  int vmaj, vmin;
+  if (version == NULL || sscanf(version, "%d.%d", &vmaj, &vmin) != 2)
+    return 0;
+  return (vmaj > major || (vmaj == major && vmin >= minor));
+}
+
+static void init_mesh_buffers(struct app_contents *app)
+{
+  int i;
+  app->use_vbo = 0;
+#ifdef GL_VERSION_1_5
+  if (gl_version_at_least(1, 5))
+  {
+    app->use_vbo = 1;
+    for (i = 0; i < NB_MESHES; i++)
+    {
+      struct item_mesh *mesh = &item_meshes[i];
+      glGenBuffers(1, &app->vbo[i]);
+      glGenBuffers(1, &app->ibo[i]);
+      glBindBuffer(GL_ARRAY_BUFFER, app->vbo[i]);
+      glBufferData(GL_ARRAY_BUFFER, mesh->num_verts * 3 * sizeof(GLfloat),
+                   mesh->verts, GL_STATIC_DRAW);
+      glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, app->ibo[i]);
+      glBufferData(GL_ELEMENT_ARRAY_BUFFER,
+                   mesh->num_indices * sizeof(GLushort),
+                   mesh->indices, GL_STATIC_DRAW);
+    }
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+  }
+#endif
+}
+
+/* the vertices of a mesh stay bound for all the items of a frame */
+static void bind_item_mesh(const struct app_contents *app, int m)
+{
+  glEnableClientState(GL_VERTEX_ARRAY);
+#ifdef GL_VERSION_1_5
+  if (app->use_vbo)
+  {
+    glBindBuffer(GL_ARRAY_BUFFER, app->vbo[m]);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, app->ibo[m]);
+    glVertexPointer(3, GL_FLOAT, 0, NULL);
+    return;
+  }
+#endif
+  glVertexPointer(3, GL_FLOAT, 0, item_meshes[m].verts);
+}
+
+static void unbind_item_mesh(const struct app_contents *app)
+{
+#ifdef GL_VERSION_1_5
+  if (app->use_vbo)
+  {
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+  }
+#endif
+  glDisableClientState(GL_VERTEX_ARRAY);
+}
+
+static void draw_mesh_range(const struct app_contents *app, int m,
+                            GLenum mode, int first, int count)
+{
+  const GLushort *indices = NULL;
+  if (!app->use_vbo)
+    indices = item_meshes[m].indices;
+  glDrawElements(mode, count, GL_UNSIGNED_SHORT,
+                 (const GLvoid *) ((const char *) indices +
+                                   first * sizeof(GLushort)));
+}
+
+/* the black border, the colored item, then its wireframe */
+static void draw_item(const struct app_contents *app, int m,
+                      float r, float g, float b)
+{
+  const struct item_mesh *mesh = &item_meshes[m];
+
+  glColor3f(0.0, 0.0, 0.0);
+  if (app->zbuffer) {
+    /* only the far side of the border writes the depth, what is drawn
+       of the item afterwards is in front of it and passes the test,
+       while the items behind it fail */
+    glEnable(GL_CULL_FACE);
+    glDepthMask(GL_TRUE);
+    draw_mesh_range(app, m, GL_TRIANGLES, mesh->outer_first,
+                    mesh->closed_count);
+    glDisable(GL_CULL_FACE);
+    glDepthMask(GL_FALSE);
+  }
+  else
+    draw_mesh_range(app, m, GL_TRIANGLES, mesh->outer_first,
+                    mesh->outer_count);
+
+  glColor3f(r, g, b);
+  draw_mesh_range(app, m, GL_TRIANGLES, mesh->inner_first, mesh->inner_count);
+
+  glColor3f(1.0, 1.0, 1.0);
+  draw_mesh_range(app, m, GL_LINES, mesh->lines_first, mesh->lines_count);
+}
+
+/* }}} */
+
+/* {{{ single pass outlines */
+
+#if defined(HAVE_GLSL) && defined(GL_VERSION_2_0)
+
+/* Only the outer shell is rasterized. The view ray of each fragment is
+   intersected in object space with the inner item: the fragment is white
+   near an edge of the inner item, of the color of the item when the ray
+   hits the inner item, and black otherwise, which is what the three
+   draws leave on screen. */
+
+static const char *outline_vertex_src =
+  "varying vec3 obj_pos;\n"
+  "varying vec3 obj_eye;\n"
+  "\n"
+  "void main() {\n"
+  "  obj_pos = gl_Vertex.xyz;\n"
+  "  obj_eye = (gl_ModelViewMatrixInverse * vec4(0.0, 0.0, 0.0, 1.0)).xyz;\n"
+  "  gl_FrontColor = gl_Color;\n"
+  "  gl_Position = ftransform();\n"
+  "}\n";
+
+static const char *outline_fragment_src =
+  "uniform int shape;\n"
+  "uniform vec2 inner;\n"
+  "uniform float pixel_angle;\n"
+  "varying vec3 obj_pos;\n"
+  "varying vec3 obj_eye;\n"
+  "\n"
+  "float cube_edge(vec3 p) {\n"
+  "  vec3 q = clamp(p, -inner.x, inner.x);\n"
+  "  vec3 d = inner.x - abs(q);\n"
+  "  float lo = min(d.x, min(d.y, d.z));\n"
+  "  float hi = max(d.x, max(d.y, d.z));\n"
+  "  return length(p - q) + (d.x + d.y + d.z - lo - hi);\n"
+  "}\n"
+  "\n"
+  "float cylinder_edge(vec3 p) {\n"
+  "  float r = length(p.xy);\n"
+  "  float rings = min(length(vec2(r - inner.x, p.z - inner.y)),\n"
+  "                    length(vec2(r - inner.x, p.z + inner.y)));\n"
+  "  float step = 6.2831853 / 8.0;\n"
+  "  float a = atan(p.y, p.x);\n"
+  "  float side = length(vec2(r - inner.x, max(abs(p.z) - inner.y, 0.0)))\n"
+  "             + abs(a - floor(a / step + 0.5) * step) * inner.x;\n"
+  "  return min(rings, side);\n"
+  "}\n"
+  "\n"
+  "void main() {\n"
+  "  vec3 o = obj_eye;\n"
+  "  vec3 dir = normalize(obj_pos - obj_eye);\n"
+  "  float t0, t1, edge;\n"
+  "  bool face;\n"
+  "  if (shape == 0) {\n"
+  "    vec3 ta = (-inner.x - o) / dir;\n"
+  "    vec3 tb = (inner.x - o) / dir;\n"
+  "    vec3 tmin = min(ta, tb);\n"
+  "    vec3 tmax = max(ta, tb);\n"
+  "    t0 = max(tmin.x, max(tmin.y, tmin.z));\n"
+  "    t1 = min(tmax.x, min(tmax.y, tmax.z));\n"
+  "    face = (t0 <= t1);\n"
+  "    edge = min(cube_edge(o + t0 * dir), cube_edge(o + t1 * dir));\n"
+  "  } else {\n"
+  "    float a = dot(dir.xy, dir.xy);\n"
+  "    float b = dot(o.xy, dir.xy);\n"
+  "    float c = dot(o.xy, o.xy) - inner.x * inner.x;\n"
+  "    float disc = b * b - a * c;\n"
+  "    float s = sqrt(max(disc, 0.0));\n"
+  "    float za = (-inner.y - o.z) / dir.z;\n"
+  "    float zb = (inner.y - o.z) / dir.z;\n"
+  "    t0 = max((-b - s) / a, min(za, zb));\n"
+  "    t1 = min((-b + s) / a, max(za, zb));\n"
+  "    face = (disc >= 0.0 && t0 <= t1);\n"
+  "    edge = min(cylinder_edge(o + t0 * dir), cylinder_edge(o + t1 * dir));\n"
+  "  }\n"
+  /* the lines are one pixel wide */
+  "  if (edge < 0.5 * pixel_angle * distance(obj_pos, o))\n"
+  "    gl_FragColor = vec4(1.0, 1.0, 1.0, 1.0);\n"
+  "  else if (face)\n"
+  "    gl_FragColor = gl_Color;\n"
+  "  else\n"
+  "    gl_FragColor = vec4(0.0, 0.0, 0.0, 1.0);\n"
+  "}\n";
+
+static GLuint compile_outline_shader(GLenum type, const char *src)
+{
+  GLuint shader;
+  GLint ok;
+
+  shader = glCreateShader(type);
+  glShaderSource(shader, 1, &src, NULL);
+  glCompileShader(shader);
+  glGetShaderiv(shader, GL_COMPILE_STATUS, &ok);
+  if (!ok) {
+    char log[1024];
+    glGetShaderInfoLog(shader, sizeof(log), NULL, log);
+    fprintf(stderr, "%s: outline shader: %s\n", progname, log);
+    glDeleteShader(shader);
+    return 0;
+  }
+  return shader;
+}
+
+static void init_outline_program(struct app_contents *app)
+{
+  GLuint vs, fs, prog;
+  GLint ok;
+
+  app->outline_prog = 0;
+  if (!gl_version_at_least(2, 0))
+    return;
+
+  vs = compile_outline_shader(GL_VERTEX_SHADER, outline_vertex_src);
+  fs = compile_outline_shader(GL_FRAGMENT_SHADER, outline_fragment_src);
+  if (vs == 0 || fs == 0) {
+    if (vs) glDeleteShader(vs);
+    if (fs) glDeleteShader(fs);
+    return;
+  }
+
+  prog = glCreateProgram();
+  glAttachShader(prog, vs);
+  glAttachShader(prog, fs);
+  glLinkProgram(prog);
+  glDeleteShader(vs);
+  glDeleteShader(fs);
+
+  glGetProgramiv(prog, GL_LINK_STATUS, &ok);
+  if (!ok) {
+    char log[1024];
+    glGetProgramInfoLog(prog, sizeof(log), NULL, log);
+    fprintf(stderr, "%s: outline program: %s\n", progname, log);
+    glDeleteProgram(prog);
+    return;
+  }
+
+  app->outline_prog = prog;
+  app->outline_shape = glGetUniformLocation(prog, "shape");
+  app->outline_inner = glGetUniformLocation(prog, "inner");
+  app->outline_pixel = glGetUniformLocation(prog, "pixel_angle");
+}
+
+static void begin_outlines(const struct app_contents *app, int m)
+{
+  /* the back faces of a closed shell cover all of it, the bottom
+     of the cylinders is open, so they need all their faces */
+  if (m == CUBE_MESH)
+    glEnable(GL_CULL_FACE);
+  glUseProgram(app->outline_prog);
+  glUniform1i(app->outline_shape, (m != CUBE_MESH));
+  glUniform2fv(app->outline_inner, 1, item_meshes[m].inner_extent);
+  glUniform1f(app->outline_pixel, app->pixel_angle);
+}
+
+static void end_outlines(void)
+{
+  glUseProgram(0);
+  glDisable(GL_CULL_FACE);
+}
+
+#else /* !HAVE_GLSL */
+
+static void init_outline_program(struct app_contents *app)
+{
+  app->outline_prog = 0;
+}
+
+static void begin_outlines(const struct app_contents *app, int m) { }
+static void end_outlines(void) { }
+
+#endif /* !HAVE_GLSL */
+
+static int use_outlines(const struct app_contents *app)
+{
+  return (app->single_pass && app->outline_prog != 0);
+}
+
+/* one draw of the outer shell, the border and the lines
+   come from the fragment shader */
+static void draw_item_single_pass(const struct app_contents *app, int m,
+                                  float r, float g, float b)
+{
+  const struct item_mesh *mesh = &item_meshes[m];
+
+  glColor3f(r, g, b);
+  draw_mesh_range(app, m, GL_TRIANGLES, mesh->outer_first, mesh->outer_count);
+}
+
+/* }}} */
+
+/* {{{ overdraw measure */
+
+/* Without a depth buffer every fragment of every item is shaded and
+   written, the background excepted. An occlusion query around the
+   drawing of the items counts them, with no depth test they all pass.
+   Divided by the pixels of the viewport, this is the average overdraw,
+   a depth complexity, shown as such in the FPS overlay. Reading the
+   result waits for the end of the frame, as the glFinish before the
+   swap does anyway. */
+
+static void init_fragment_query(struct app_contents *app)
+{
+  app->frag_query = 0;
+  if (!overdraw)
+    return;
+  if (app->soft) {
+    fprintf(stderr, "%s: the overdraw is only measured with the "
+                    "gl backend\n", progname);
+    return;
+  }
+#ifdef GL_VERSION_1_5
+  if (gl_version_at_least(1, 5)) {
+    glGenQueries(1, &app->frag_query);
+    return;
+  }
+#endif
+  fprintf(stderr, "%s: measuring the overdraw needs OpenGL 1.5 "
+                  "occlusion queries\n", progname);
+}
+
+static void begin_fragment_count(struct app_contents *app)
+{
+#ifdef GL_VERSION_1_5
+  if (app->frag_query)
+    glBeginQuery(GL_SAMPLES_PASSED, app->frag_query);
+#endif
+}
+
+static void end_fragment_count(struct app_contents *app)
+{
+#ifdef GL_VERSION_1_5
+  if (app->frag_query)
+    glEndQuery(GL_SAMPLES_PASSED);
+#endif
+}
+
+static unsigned long read_fragment_count(struct app_contents *app)
+{
+  GLuint count = 0;
+#ifdef GL_VERSION_1_5
+  if (app->frag_query)
+    glGetQueryObjectuiv(app->frag_query, GL_QUERY_RESULT, &count);
+#endif
+  return count;
+}
+
+static double overdraw_of(const struct app_contents *app, double fragments)
+{
+  return fragments / (app->pixels > 0 ? app->pixels : 1);
+}
+
+/* }}} */
+
+static void gradient_color(float y, float radius, float *r, float *g, float *b)
+{
+  float v;
+  v = y + radius;
+  v = v / radius / 2.;
+  v = v * 1.4;
+  *r = v;
+  *b = 1.0 - v;
+  *g = 0.0;
+}
+
+/* half size of the items along each axis, border included */
+static const float cube_extent[3] = { 0.25, 0.25, 0.25 };
+static const float cylinder_extent[3] = { 1.1 * 0.10, 1.1 * 0.10, 0.10 };
+
+/* the CPU part of a frame is made of the three steps below, it makes
+   no GL call so it can run in the frame worker */
+
+/* view matrix and positions in view space */
+static void prepare_view(struct app_contents *app)
+{
+  if (app->type == CUBE_GEOM)
+  {
+    struct cube_geom *geom = &(app->geom.cube_app);
+    build_view_matrix(app->view, app->anglex, app->angley, 3.0 / geom->side);
+    parallel_transform(app->view, geom->pos, geom->view_pos,
+                       geom->num_items, pool_parts(geom->num_items));
+  }
+
+  if (app->type == CYLINDER_GEOM)
+  {
+    struct cylinder_geom *geom = &(app->geom.cylinder_app);
+    build_view_matrix(app->view, app->anglex, app->angley, 1.0);
+    parallel_transform(app->view, geom->pos, geom->view_pos,
+                       geom->num_items, pool_parts(geom->num_items));
+  }
+}
+
+/* the drawing order */
+static void prepare_order(struct app_contents *app)
+{
+  if (app->type == CUBE_GEOM)
+  {
+    struct cube_geom *geom = &(app->geom.cube_app);
+    float step = 0.8;
+
+    /* the cubes are a regular lattice, the order comes from the
+       position of the eye, otherwise sort the items along the Z axis,
+       the depth buffer does not need a sort */
+    if (app->order == ORDER_SORT && !app->zbuffer)
+      app->frame_order = coherent_sort(app, geom->view_pos[2],
+          geom->keys, geom->keys_tmp, geom->num_items);
+    else if (app->order == ORDER_BSP)
+    {
+      if (!geom->bsp.built)
+        build_bsp(&(geom->bsp), geom->pos, cube_extent, geom->num_items);
+      app->frame_order = bsp_order(app->view, &(geom->bsp),
+                                   geom->view_pos[2], geom->keys,
+                                   geom->keys_tmp);
+    }
+    else
+      app->frame_order = lattice_order(app->view, geom->side, step,
+                                       geom->axis_order, geom->keys);
+
+    /* the depth sort is not an exact painter's order */
+    geom->culled = False;
+    if (do_cull && (app->order != ORDER_SORT || app->zbuffer))
+      occlusion_cull(app, cube_extent[0]);
+  }
+
+  if (app->type == CYLINDER_GEOM)
+  {
+    struct cylinder_geom *geom = &(app->geom.cylinder_app);
+
+    /* the cylinders are not a lattice, the BSP tree
+       gives their order, or sort them along the Z axis */
+    if (app->order == ORDER_SORT && !app->zbuffer)
+      app->frame_order = coherent_sort(app, geom->view_pos[2],
+          geom->keys, geom->keys_tmp, geom->num_items);
+    else
+    {
+      if (!geom->bsp.built)
+        build_bsp(&(geom->bsp), geom->pos, cylinder_extent,
+                  geom->num_items);
+      app->frame_order = bsp_order(app->view, &(geom->bsp),
+                                   geom->view_pos[2], geom->keys,
+                                   geom->keys_tmp);
+    }
+  }
+}
+
+/* the color of each item, from the palette or the vertical gradient;
+   the items left out of the frame keep their old one */
+static void colors_part(void *arg, int part, int num_parts)
+{
+  const struct app_contents *app = (const struct app_contents *) arg;
+  int i, lo, hi;
+
+  if (app->type == CUBE_GEOM)
+  {
+    const struct cube_geom *geom = &(app->geom.cube_app);
+    float half = 0.8 * ((float)(geom->side - 1)) / 2.0;
+    float radius = sqrt(half * half * 3.) * 0.5;
+
+    part_range(geom->num_items, part, num_parts, &lo, &hi);
+    for (i = lo; i < hi; i++) {
+      float *c = geom->rgb + 3 * i;
+      if (!get_cube_visibility(app, i))
+        continue;
+      if (geom->culled && get_vis_bit(geom->hidden, i))
+        continue;
+      if (app->draw_mode)
+        gradient_color(geom->view_pos[1][i], radius, &c[0], &c[1], &c[2]);
+      else
+        get_cube_color(app, i, &c[0], &c[1], &c[2]);
+    }
+  }
+
+  if (app->type == CYLINDER_GEOM)
+  {
+    const struct cylinder_geom *geom = &(app->geom.cylinder_app);
+    /* radius of the circle of cylinders */
+    float half = 1.3;
+    float radius = sqrt(half * half * 3.) * 0.5;
+
+    part_range(geom->num_items, part, num_parts, &lo, &hi);
+    for (i = lo; i < hi; i++) {
+      float *c = geom->rgb + 3 * i;
+      if (!get_cylinder_visibility(app, i))
+        continue;
+      if (app->draw_mode)
+        gradient_color(geom->view_pos[1][i], radius, &c[0], &c[1], &c[2]);
+      else
+        get_cylinder_color(app, i, &c[0], &c[1], &c[2]);
+    }
+  }
+}
+
+static void prepare_colors(struct app_contents *app)
+{
+  int n = (app->type == CUBE_GEOM ? app->geom.cube_app.num_items
+                                   : app->geom.cylinder_app.num_items);
+  pool_run(colors_part, app, pool_parts(n));
+}
+
+static void prepare_frame(struct app_contents *app)
+{
+  prepare_view(app);
+  prepare_order(app);
+  prepare_colors(app);
+  app->frame_ready = True;
+}
+
+/* the level of detail of a cylinder at the depth z in view space, from
+   the size of a pixel set by the perspective of reshape_unsorted() */
+static int cylinder_lod(const struct app_contents *app, float z)
+{
+  float radius = cylinder_extent[0] / (-z * app->pixel_angle);
+  int l = NB_CYLINDER_LODS - 1;
+
+  if (!use_lod || z >= 0.0)
+    return 0;
+  while (l > 0 && radius > lod_max_radius[l])
+    l--;
+  return l;
+}
+
+/* the painter's order, or front to back with the depth buffer, so
+   that the items in front fill it first and the others fail early */
+static int order_slot(const struct app_contents *app, int i, int n)
+{
+  return (app->zbuffer ? n - 1 - i : i);
+}
+
+/* only the submission of the prepared frame is left here */
+static void main_display (struct app_contents *app) {
+  struct sort_key *order;
+  int outlined;
+  int i;
+
+  if (!app->frame_ready)
+    prepare_frame(app);
+  order = app->frame_order;
+  outlined = use_outlines(app);
+
+  if (app->draw_mode)
+    glClearColor(0.24, 0.25, 0.26, 0.0);
+  else
+    glClearColor(0.38, 0.16, 0.0, 0.0);
+
+  if (app->zbuffer) {
+    glDepthMask(GL_TRUE);
+    glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+  }
+  else
+    glClear(GL_COLOR_BUFFER_BIT);
+
+  if (app->type == CUBE_GEOM)
+  {
+    struct cube_geom *geom = &(app->geom.cube_app);
+
+    /* finally do draw the cubes */
+    bind_item_mesh(app, CUBE_MESH);
+    if (outlined)
+      begin_outlines(app, CUBE_MESH);
+    for (i=0; i < geom->num_items; i++)
+    {
+      int index = order[order_slot(app, i, geom->num_items)].index;
+      const float *c = geom->rgb + 3 * index;
+
+      if (!get_cube_visibility(app, index))
+        continue;
+      if (geom->culled && get_vis_bit(geom->hidden, index))
+        continue;
+
+      load_item_matrix(app->view,
+          geom->view_pos[0][index],
+          geom->view_pos[1][index],
+          geom->view_pos[2][index]);
+
+      if (outlined)
+        draw_item_single_pass(app, CUBE_MESH, c[0], c[1], c[2]);
+      else
+        draw_item(app, CUBE_MESH, c[0], c[1], c[2]);
+    }
+    if (outlined)
+      end_outlines();
+    unbind_item_mesh(app);
+  }
+
+  if (app->type == CYLINDER_GEOM)
+  {
+    struct cylinder_geom *geom = &(app->geom.cylinder_app);
+    int bound = -1;
+
+    if (outlined)
+      begin_outlines(app, CYLINDER_MESH);
+    for (i=0; i < geom->num_items; i++)
+    {
+      int index = order[order_slot(app, i, geom->num_items)].index;
+      const float *c = geom->rgb + 3 * index;
+      int m;
+
+      if (!get_cylinder_visibility(app, index))
+        continue;
+
+      /* the mesh only changes between the levels of detail */
+      m = CYLINDER_MESH + cylinder_lod(app, geom->view_pos[2][index]);
+      if (m != bound) {
+        bind_item_mesh(app, m);
+        bound = m;
+      }
+      app->stats.lod_items[m - CYLINDER_MESH]++;
+
+      load_item_matrix(app->view,
+          geom->view_pos[0][index],
+          geom->view_pos[1][index],
+          geom->view_pos[2][index]);
+
+      if (outlined)
+        draw_item_single_pass(app, m, c[0], c[1], c[2]);
+      else
+        draw_item(app, m, c[0], c[1], c[2]);
+    }
+    if (outlined)
+      end_outlines();
+    unbind_item_mesh(app);
+  }
+}
+
+/* {{{ software backend */
+
+/* -backend soft draws the frames without GL, straight into an XImage.
+   The items are flat and drawn in the painter's order, so it only takes
+   convex polygons and lines: the outer and the inner shells of an item
+   each cover the convex hull of their projected vertices, whatever the
+   faces seen. The image is cut in horizontal bands, one per thread, and
+   each band goes through all the items in order, so the order is kept
+   on every pixel without any depth buffer. The items are set up (their
+   vertices projected and their hulls found) by chunks, in parallel too,
+   then drawn by the bands. */
+
+#define SOFT_CHUNK 4096
+
+struct soft_item {
+  int num_outer;             /* 0 for an item not drawn */
+  int num_inner;
+  int row_min, row_max;      /* rows touched */
+  unsigned int color;
+  float outer[HULL_MAX_POINTS][2];
+  float inner[HULL_MAX_POINTS][2];
+  float verts[HULL_MAX_POINTS][2];  /* the inner shell, for the lines */
+};
+
+struct soft_job {
+  struct app_contents *app;
+  struct soft_target *fb;
+  const struct item_mesh *mesh;
+  float *const *view_pos;
+  const float *rgb;
+  float offset[2 * HULL_MAX_POINTS][3];  /* mesh vertices in view space */
+  float focal;
+  unsigned int background, black, white;
+  int first, count;          /* the chunk, in the drawing order */
+};
+
+static int mask_shift(unsigned long mask)
+{
+  int shift;
+  for (shift = 0; shift < 32; shift += 8)
+    if (mask == (0xffUL << shift))
+      return shift;
+  return -1;
+}
+
+static unsigned int soft_pixel(const struct soft_target *fb,
+                               float r, float g, float b)
+{
+  float c[3];
+  unsigned int pixel = 0;
+  int i;
+
+  c[0] = r; c[1] = g; c[2] = b;
+  for (i = 0; i < 3; i++)
+  {
+    float v = (c[i] < 0.0 ? 0.0 : c[i] > 1.0 ? 1.0 : c[i]);
+    pixel |= ((unsigned int) (v * 255.0 + 0.5)) << fb->shift[i];
+  }
+  return pixel;
+}
+
+static unsigned int *soft_row(const struct soft_target *fb, int row)
+{
+  return (unsigned int *) (fb->image->data +
+                           (long) row * fb->image->bytes_per_line);
+}
+
+/* pixels x0 to x1 excluded */
+static void soft_span(unsigned int *row, int x0, int x1, unsigned int color)
+{
+#ifdef __SSE2__
+  __m128i c = _mm_set1_epi32(color);
+  for (; x0 + 4 <= x1; x0 += 4)
+    _mm_storeu_si128((__m128i *) (row + x0), c);
+#endif
+  for (; x0 < x1; x0++)
+    row[x0] = color;
+}
+
+/* fills the pixels whose center is inside the convex polygon, on the
+   rows y0 to y1 excluded, as the GL does for its triangles */
+static void soft_fill_hull(const struct soft_target *fb,
+                           float (*p)[2], int n, unsigned int color,
+                           int y0, int y1)
+{
+  int width = fb->image->width;
+  float *left = fb->span, *right = fb->span + fb->image->height;
+  float ymin = p[0][1], ymax = p[0][1];
+  int i, row, r0, r1;
+
+  if (n < 3)
+    return;
+
+  for (i = 1; i < n; i++) {
+    ymin = fminf(ymin, p[i][1]);
+    ymax = fmaxf(ymax, p[i][1]);
+  }
+  r0 = (int) ceilf(ymin - 0.5);
+  r1 = (int) ceilf(ymax - 0.5);
+  if (r0 < y0) r0 = y0;
+  if (r1 > y1) r1 = y1;
+  if (r0 >= r1)
+    return;
+
+  for (row = r0; row < r1; row++) {
+    left[row] = 1e30;
+    right[row] = -1e30;
+  }
+
+  for (i = 0; i < n; i++)
+  {
+    const float *a = p[i], *b = p[(i + 1) % n];
+    float dxdy;
+    int e0, e1;
+
+    if (a[1] == b[1])
+      continue;
+    dxdy = (b[0] - a[0]) / (b[1] - a[1]);
+    e0 = (int) ceilf(fminf(a[1], b[1]) - 0.5);
+    e1 = (int) ceilf(fmaxf(a[1], b[1]) - 0.5);
+    if (e0 < r0) e0 = r0;
+    if (e1 > r1) e1 = r1;
+    for (row = e0; row < e1; row++)
+    {
+      float x = a[0] + (row + 0.5 - a[1]) * dxdy;
+      left[row] = fminf(left[row], x);
+      right[row] = fmaxf(right[row], x);
+    }
+  }
+
+  for (row = r0; row < r1; row++)
+  {
+    int x0 = (int) ceilf(left[row] - 0.5);
+    int x1 = (int) ceilf(right[row] - 0.5);
+    if (x0 < 0) x0 = 0;
+    if (x1 > width) x1 = width;
+    if (x0 < x1)
+      soft_span(soft_row(fb, row), x0, x1, color);
+  }
+}
+
+/* one pixel wide, one pixel per column or per row along the major
+   axis, on the rows y0 to y1 excluded */
+static void soft_line(const struct soft_target *fb,
+                      const float *a, const float *b, unsigned int color,
+                      int y0, int y1)
+{
+  int width = fb->image->width;
+  float dx = b[0] - a[0], dy = b[1] - a[1];
+  int i, i0, i1;
+
+  if (fabsf(dx) >= fabsf(dy))
+  {
+    float slope;
+    if (dx == 0.0)
+      return;
+    if (dx < 0.0) {
+      const float *t = a; a = b; b = t;
+      dx = -dx; dy = -dy;
+    }
+    slope = dy / dx;
+    i0 = (int) ceilf(a[0] - 0.5);
+    i1 = (int) ceilf(b[0] - 0.5);
+    if (i0 < 0) i0 = 0;
+    if (i1 > width) i1 = width;
+    for (i = i0; i < i1; i++)
+    {
+      int row = (int) floorf(a[1] + (i + 0.5 - a[0]) * slope);
+      if (row >= y0 && row < y1)
+        soft_row(fb, row)[i] = color;
+    }
+  }
+  else
+  {
+    float slope;
+    if (dy < 0.0) {
+      const float *t = a; a = b; b = t;
+      dx = -dx; dy = -dy;
+    }
+    slope = dx / dy;
+    i0 = (int) ceilf(a[1] - 0.5);
+    i1 = (int) ceilf(b[1] - 0.5);
+    if (i0 < y0) i0 = y0;
+    if (i1 > y1) i1 = y1;
+    for (i = i0; i < i1; i++)
+    {
+      int col = (int) floorf(a[0] + (i + 0.5 - a[1]) * slope);
+      if (col >= 0 && col < width)
+        soft_row(fb, i)[col] = color;
+    }
+  }
+}
+
+static Bool soft_item_drawn(const struct app_contents *app, int index)
+{
+  if (app->type == CUBE_GEOM) {
+    const struct cube_geom *geom = &(app->geom.cube_app);
+    if (geom->culled && get_vis_bit(geom->hidden, index))
+      return False;
+    return get_cube_visibility(app, index);
+  }
+  return get_cylinder_visibility(app, index);
+}
+
+static void soft_clear_job(void *arg, int part, int num_parts)
+{
+  struct soft_job *job = arg;
+  const XImage *image = job->fb->image;
+  int y0 = (long) image->height * part / num_parts;
+  int y1 = (long) image->height * (part + 1) / num_parts;
+  int row;
+
+  for (row = y0; row < y1; row++)
+    soft_span(soft_row(job->fb, row), 0, image->width, job->background);
+}
+
+/* projects the vertices of the items of the chunk to the image, the
+   rows go down, the projection has an aspect of 1 as with the GL */
+static void soft_setup_job(void *arg, int part, int num_parts)
+{
+  struct soft_job *job = arg;
+  const struct app_contents *app = job->app;
+  const struct sort_key *order = app->frame_order;
+  const XImage *image = job->fb->image;
+  int half = job->mesh->num_verts / 2;
+  float sx = 0.5 * image->width, sy = 0.5 * image->height;
+  int k, lo, hi;
+
+  part_range(job->count, part, num_parts, &lo, &hi);
+  for (k = lo; k < hi; k++)
+  {
+    struct soft_item *item = &(job->fb->items[k]);
+    int index = order[job->first + k].index;
+    float x = job->view_pos[0][index];
+    float y = job->view_pos[1][index];
+    float z = job->view_pos[2][index];
+    float ymin = 1e30, ymax = -1e30;
+    const float *c;
+    int v;
+
+    item->num_outer = 0;
+    if (!soft_item_drawn(app, index))
+      continue;
+
+    for (v = 0; v < 2 * half; v++)
+    {
+      float (*pt)[2] = (v < half ? &item->outer[v] : &item->verts[v - half]);
+      float w = -(z + job->offset[v][2]);
+      /* no clipping, the scenes stay far behind the near plane */
+      if (w < 0.5)
+        break;
+      (*pt)[0] = (1.0 + job->focal * (x + job->offset[v][0]) / w) * sx;
+      (*pt)[1] = (1.0 - job->focal * (y + job->offset[v][1]) / w) * sy;
+      ymin = fminf(ymin, (*pt)[1]);
+      ymax = fmaxf(ymax, (*pt)[1]);
+    }
+    if (v < 2 * half)
+      continue;
+
+    memcpy(item->inner, item->verts, half * sizeof(item->verts[0]));
+    item->num_outer = convex_hull(item->outer, half);
+    item->num_inner = convex_hull(item->inner, half);
+    item->row_min = (int) floorf(ymin) - 1;
+    item->row_max = (int) ceilf(ymax) + 1;
+    c = job->rgb + 3 * index;
+    item->color = soft_pixel(job->fb, c[0], c[1], c[2]);
+  }
+}
+
+/* the band draws the border, the inner shell and its wireframe of each
+   item in turn, as draw_item() */
+static void soft_raster_job(void *arg, int part, int num_parts)
+{
+  struct soft_job *job = arg;
+  const struct item_mesh *mesh = job->mesh;
+  int half = mesh->num_verts / 2;
+  int height = job->fb->image->height;
+  int y0 = (long) height * part / num_parts;
+  int y1 = (long) height * (part + 1) / num_parts;
+  int k, l;
+
+  for (k = 0; k < job->count; k++)
+  {
+    struct soft_item *item = &(job->fb->items[k]);
+
+    if (item->num_outer == 0 || item->row_max < y0 || item->row_min >= y1)
+      continue;
+
+    soft_fill_hull(job->fb, item->outer, item->num_outer, job->black, y0, y1);
+    soft_fill_hull(job->fb, item->inner, item->num_inner, item->color,
+                   y0, y1);
+    for (l = 0; l < mesh->lines_count; l += 2)
+    {
+      int a = mesh->indices[mesh->lines_first + l] - half;
+      int b = mesh->indices[mesh->lines_first + l + 1] - half;
+      soft_line(job->fb, item->verts[a], item->verts[b], job->white, y0, y1);
+    }
   }
-  glPopMatrix();
 }
 
+/* the same frame as main_display(), in the image */
+static void soft_display(struct app_contents *app)
+{
+  struct soft_target *fb = &app->soft_fb;
+  struct soft_job job;
+  const GLfloat *m = app->view;
+  int v, n, parts;
+
+  if (!app->frame_ready)
+    prepare_frame(app);
+  if (fb->image == NULL)
+    return;
+
+  job.app = app;
+  job.fb = fb;
+  job.focal = 1.0 / tan(VIEW_FOVY / 2.0 * M_PI / 180.0);
+  if (app->draw_mode)
+    job.background = soft_pixel(fb, 0.24, 0.25, 0.26);
+  else
+    job.background = soft_pixel(fb, 0.38, 0.16, 0.0);
+  job.black = soft_pixel(fb, 0.0, 0.0, 0.0);
+  job.white = soft_pixel(fb, 1.0, 1.0, 1.0);
+
+  if (app->type == CUBE_GEOM) {
+    struct cube_geom *geom = &(app->geom.cube_app);
+    job.mesh = &item_meshes[CUBE_MESH];
+    job.view_pos = geom->view_pos;
+    job.rgb = geom->rgb;
+    n = geom->num_items;
+  } else {
+    struct cylinder_geom *geom = &(app->geom.cylinder_app);
+    job.mesh = &item_meshes[CYLINDER_MESH];
+    job.view_pos = geom->view_pos;
+    job.rgb = geom->rgb;
+    n = geom->num_items;
+  }
+
+  for (v = 0; v < job.mesh->num_verts; v++)
+  {
+    const GLfloat *p = job.mesh->verts + 3 * v;
+    job.offset[v][0] = m[0] * p[0] + m[4] * p[1] + m[8]  * p[2];
+    job.offset[v][1] = m[1] * p[0] + m[5] * p[1] + m[9]  * p[2];
+    job.offset[v][2] = m[2] * p[0] + m[6] * p[1] + m[10] * p[2];
+  }
+
+  parts = pool_threads();
+  pool_run(soft_clear_job, &job, parts);
+  for (job.first = 0; job.first < n; job.first += SOFT_CHUNK)
+  {
+    job.count = n - job.first;
+    if (job.count > SOFT_CHUNK)
+      job.count = SOFT_CHUNK;
+    pool_run(soft_setup_job, &job, parts);
+    pool_run(soft_raster_job, &job, parts);
+  }
+}
+
+#ifdef HAVE_XSHM_EXTENSION
+static Bool shm_failed;
+
+static int shm_error_handler(Display *dpy, XErrorEvent *error)
+{
+  (void) dpy;
+  (void) error;
+  shm_failed = True;
+  return 0;
+}
+
+/* NULL when the segment can not be shared, with a remote display */
+static XImage *create_shm_image(ModeInfo *mi, struct soft_target *fb,
+                                int width, int height)
+{
+  Display *dpy = MI_DISPLAY(mi);
+  int (*old_handler)(Display *, XErrorEvent *);
+  XShmSegmentInfo *info = &fb->shm_info;
+  XImage *image;
+
+  if (!XShmQueryExtension(dpy))
+    return NULL;
+
+  image = XShmCreateImage(dpy, MI_VISUAL(mi), MI_DEPTH(mi), ZPixmap,
+                          NULL, info, width, height);
+  if (image == NULL)
+    return NULL;
+
+  info->shmid = shmget(IPC_PRIVATE, (size_t) image->bytes_per_line * height,
+                       IPC_CREAT | 0600);
+  if (info->shmid < 0) {
+    XDestroyImage(image);
+    return NULL;
+  }
+  info->shmaddr = shmat(info->shmid, NULL, 0);
+  info->readOnly = False;
+  if (info->shmaddr == (char *) -1) {
+    shmctl(info->shmid, IPC_RMID, NULL);
+    XDestroyImage(image);
+    return NULL;
+  }
+
+  XSync(dpy, False);
+  shm_failed = False;
+  old_handler = XSetErrorHandler(shm_error_handler);
+  XShmAttach(dpy, info);
+  XSync(dpy, False);
+  XSetErrorHandler(old_handler);
+
+  /* the segment goes away once both sides have detached it */
+  shmctl(info->shmid, IPC_RMID, NULL);
+
+  if (shm_failed) {
+    shmdt(info->shmaddr);
+    XDestroyImage(image);
+    return NULL;
+  }
+  image->data = info->shmaddr;
+  fb->shm = True;
+  return image;
+}
+#endif /* HAVE_XSHM_EXTENSION */
+
+static void destroy_soft_image(Display *dpy, struct soft_target *fb)
+{
+  if (fb->image == NULL)
+    return;
+#ifdef HAVE_XSHM_EXTENSION
+  if (fb->shm) {
+    XShmDetach(dpy, &fb->shm_info);
+    XSync(dpy, False);
+    fb->image->data = NULL;
+    XDestroyImage(fb->image);
+    shmdt(fb->shm_info.shmaddr);
+    fb->shm = False;
+    fb->image = NULL;
+    return;
+  }
+#endif
+  XDestroyImage(fb->image);
+  fb->image = NULL;
+}
+
+/* on each reshape, False when the visual is not a 32 bit true color */
+static Bool resize_soft_target(ModeInfo *mi, struct soft_target *fb,
+                               int width, int height)
+{
+  Display *dpy = MI_DISPLAY(mi);
+  XImage *image = NULL;
+
+  destroy_soft_image(dpy, fb);
+  if (width <= 0 || height <= 0)
+    return True;
+
+  if (fb->gc == NULL)
+    fb->gc = XCreateGC(dpy, MI_WINDOW(mi), 0, NULL);
+  if (fb->items == NULL)
+    fb->items = malloc(SOFT_CHUNK * sizeof(struct soft_item));
+  free(fb->span);
+  fb->span = malloc(2 * height * sizeof(float));
+  if (fb->items == NULL || fb->span == NULL) {
+    fprintf(stderr, "%s: out of memory\n", progname);
+    exit(1);
+  }
+
+#ifdef HAVE_XSHM_EXTENSION
+  image = create_shm_image(mi, fb, width, height);
+#endif
+  if (image == NULL) {
+    image = XCreateImage(dpy, MI_VISUAL(mi), MI_DEPTH(mi), ZPixmap, 0,
+                         NULL, width, height, 32, 0);
+    if (image == NULL)
+      return False;
+    image->data = malloc((size_t) image->bytes_per_line * height);
+    if (image->data == NULL) {
+      fprintf(stderr, "%s: out of memory\n", progname);
+      exit(1);
+    }
+  }
+  fb->image = image;
+
+  fb->shift[0] = mask_shift(image->red_mask);
+  fb->shift[1] = mask_shift(image->green_mask);
+  fb->shift[2] = mask_shift(image->blue_mask);
+  if (image->bits_per_pixel != 32 ||
+      fb->shift[0] < 0 || fb->shift[1] < 0 || fb->shift[2] < 0) {
+    destroy_soft_image(dpy, fb);
+    return False;
+  }
+  return True;
+}
+
+static void release_soft_target(Display *dpy, struct soft_target *fb)
+{
+  destroy_soft_image(dpy, fb);
+  if (fb->gc != NULL)
+    XFreeGC(dpy, fb->gc);
+  free(fb->items);
+  free(fb->span);
+  memset(fb, 0, sizeof(struct soft_target));
+}
+
+static void soft_present(ModeInfo *mi, struct soft_target *fb)
+{
+  XImage *image = fb->image;
+
+  if (image == NULL)
+    return;
+#ifdef HAVE_XSHM_EXTENSION
+  if (fb->shm) {
+    XShmPutImage(MI_DISPLAY(mi), MI_WINDOW(mi), fb->gc, image,
+                 0, 0, 0, 0, image->width, image->height, False);
+    /* the next frame is drawn in the same memory */
+    XSync(MI_DISPLAY(mi), False);
+    return;
+  }
+#endif
+  XPutImage(MI_DISPLAY(mi), MI_WINDOW(mi), fb->gc, image,
+            0, 0, 0, 0, image->width, image->height);
+  XFlush(MI_DISPLAY(mi));
+}
+
+/* fps_draw() draws into the GL back buffer, which this backend never
+   shows, so the rate is drawn over the image with Xlib */
+static void soft_draw_fps(ModeInfo *mi, struct soft_target *fb, double fps)
+{
+  XImage *image = fb->image;
+  char text[64];
+  int len;
+
+  if (image == NULL)
+    return;
+  len = snprintf(text, sizeof(text), "FPS: %.1f", fps);
+  /* white, in the visual of the image */
+  XSetForeground(MI_DISPLAY(mi), fb->gc,
+                 image->red_mask | image->green_mask | image->blue_mask);
+  XDrawString(MI_DISPLAY(mi), MI_WINDOW(mi), fb->gc,
+              10, image->height - 10, text, len);
+  XFlush(MI_DISPLAY(mi));
+}
+
+/* }}} */
+
+/* {{{ sort benchmark */
+
+/* the former item record, with its modelview matrix,
+   moved around by qsort() */
+struct bench_record {
+  float r, g, b;
+  int vis;
+  GLfloat mat[16];
+};
+
+static int bench_z_compare(const void * _a, const void * _b)
+{
+  const struct bench_record *a, *b;
+  a = (const struct bench_record *) _a;
+  b = (const struct bench_record *) _b;
+  if (a->mat[14] > b->mat[14])
+    return 1;
+  else
+    return -1;
+}
+
+static double bench_gettime(void)
+{
+  struct timeval tp;
+  gettimeofday(&tp, NULL);
+  return ((double) tp.tv_sec + (double) tp.tv_usec / 1e6);
+}
+
+static void *bench_alloc(size_t size)
+{
+  void *p = malloc(size);
+  if (p == NULL) {
+    fprintf(stderr, "%s: out of memory\n", progname);
+    exit(1);
+  }
+  return p;
+}
+
+/* the transform, the keys and the sort of 10^6 cubes
+   with 1 to -threads threads */
+static void thread_scaling_benchmark(void)
+{
+  int side = 100;
+  int n = side * side * side;
+  int frames = 10;
+  float *pos[3], *view_pos[3];
+  struct sort_key *keys, *keys_tmp;
+  struct radix_job *radix;
+  GLfloat view[16];
+  float step = 0.8, half;
+  double t_one = 0.0;
+  int i, j, k, t, index;
+
+  start_thread_pool(num_threads);
+
+  for (i = 0; i < 3; i++) {
+    pos[i] = bench_alloc(n * sizeof(float));
+    view_pos[i] = bench_alloc(n * sizeof(float));
+  }
+  keys = bench_alloc(n * sizeof(struct sort_key));
+  keys_tmp = bench_alloc(n * sizeof(struct sort_key));
+  radix = alloc_radix_job();
+
+  half = step * ((float)(side - 1)) / 2.0;
+  index = 0;
+  for (i=0; i < side; i++)
+    for (j=0; j < side; j++)
+      for (k=0; k < side; k++)
+      {
+        pos[0][index] = (((float)i) * step) - half;
+        pos[1][index] = (((float)j) * step) - half;
+        pos[2][index] = (((float)k) * step) - half;
+        index++;
+      }
+
+  printf("%s: transform and sort of %d items, time per frame\n",
+         progname, n);
+  printf("  threads     transform       keys       sort      total   speedup\n");
+
+  for (t = 1; t <= pool_threads(); t++)
+  {
+    double t_transform = 0.0, t_keys = 0.0, t_sort = 0.0, total;
+    float anglex = 30.0, angley = 60.0;
+    int f;
+
+    for (f = 0; f < frames; f++)
+    {
+      struct sort_key *order;
+      double t0, t1, t2, t3;
+
+      build_view_matrix(view, anglex, angley, 3.0 / side);
+
+      t0 = bench_gettime();
+      parallel_transform(view, pos, view_pos, n, t);
+      t1 = bench_gettime();
+      parallel_sort_keys(view_pos[2], keys, n, False, t);
+      t2 = bench_gettime();
+      order = parallel_radix_sort_keys(radix, keys, keys_tmp, n, t);
+      t3 = bench_gettime();
+
+      t_transform += t1 - t0;
+      t_keys += t2 - t1;
+      t_sort += t3 - t2;
+
+      for (i = 1; i < n; i++)
+        if (view_pos[2][order[i - 1].index] > view_pos[2][order[i].index]) {
+          fprintf(stderr, "%s: sort benchmark: wrong order\n", progname);
+          exit(1);
+        }
+
+      anglex += 0.02;
+      angley += 0.2;
+    }
+
+    total = t_transform + t_keys + t_sort;
+    if (t == 1)
+      t_one = total;
+    printf("  %7d  %9.2f ms  %6.2f ms  %6.2f ms  %6.2f ms  %7.2fx\n", t,
+           t_transform / frames * 1e3, t_keys / frames * 1e3,
+           t_sort / frames * 1e3, total / frames * 1e3, t_one / total);
+  }
+
+  for (i = 0; i < 3; i++) {
+    free(pos[i]);
+    free(view_pos[i]);
+  }
+  free(keys);
+  free(keys_tmp);
+  free(radix);
+}
+
+/* compares the former qsort() of the item records with the radix sort
+   of the depth keys, on the cube lattice rotating as in the demo */
+static void sort_benchmark(void)
+{
+  static const int sides[] = { 7, 20, 50, 100 };
+  int s;
+
+  printf("%s: depth sort of a cube lattice, time per frame\n", progname);
+  printf("   side      items       qsort       radix   speedup\n");
+
+  for (s = 0; s < countof(sides); s++)
+  {
+    int side = sides[s];
+    int n = side * side * side;
+    int frames = 1 + 4000000 / n;
+    float *pos[3], *view_pos[3];
+    struct bench_record *records;
+    struct sort_key *keys, *keys_tmp;
+    GLfloat view[16];
+    float anglex = 30.0, angley = 60.0;
+    float step = 0.8, half;
+    double t_qsort = 0.0, t_radix = 0.0;
+    int i, j, k, f, index;
+
+    for (i = 0; i < 3; i++) {
+      pos[i] = bench_alloc(n * sizeof(float));
+      view_pos[i] = bench_alloc(n * sizeof(float));
+    }
+    records = bench_alloc(n * sizeof(struct bench_record));
+    keys = bench_alloc(n * sizeof(struct sort_key));
+    keys_tmp = bench_alloc(n * sizeof(struct sort_key));
+
+    half = step * ((float)(side - 1)) / 2.0;
+    index = 0;
+    for (i=0; i < side; i++)
+      for (j=0; j < side; j++)
+        for (k=0; k < side; k++)
+        {
+          pos[0][index] = (((float)i) * step) - half;
+          pos[1][index] = (((float)j) * step) - half;
+          pos[2][index] = (((float)k) * step) - half;
+          index++;
+        }
+
+    for (f = 0; f < frames; f++)
+    {
+      struct sort_key *order;
+      double t0, t1, t2;
+
+      build_view_matrix(view, anglex, angley, 3.0 / side);
+      transform_positions(view, pos[0], pos[1], pos[2],
+          view_pos[0], view_pos[1], view_pos[2], n);
+
+      t0 = bench_gettime();
+      for (i = 0; i < n; i++) {
+        records[i].vis = 1;
+        memcpy(records[i].mat, view, 12 * sizeof(GLfloat));
+        records[i].mat[12] = view_pos[0][i];
+        records[i].mat[13] = view_pos[1][i];
+        records[i].mat[14] = view_pos[2][i];
+        records[i].mat[15] = 1.0;
+      }
+      qsort(records, n, sizeof(struct bench_record), bench_z_compare);
+
+      t1 = bench_gettime();
+      make_sort_keys(view_pos[2], keys, n);
+      order = radix_sort_keys(keys, keys_tmp, n);
+      t2 = bench_gettime();
+
+      t_qsort += t1 - t0;
+      t_radix += t2 - t1;
+
+      for (i = 1; i < n; i++)
+        if (view_pos[2][order[i - 1].index] > view_pos[2][order[i].index] ||
+            records[i - 1].mat[14] > records[i].mat[14]) {
+          fprintf(stderr, "%s: sort benchmark: wrong order\n", progname);
+          exit(1);
+        }
+
+      anglex += 0.02;
+      angley += 0.2;
+    }
+
+    printf("  %5d  %9d  %8.1f us  %8.1f us  %7.1fx\n", side, n,
+           t_qsort / frames * 1e6, t_radix / frames * 1e6,
+           t_qsort / t_radix);
+
+    for (i = 0; i < 3; i++) {
+      free(pos[i]);
+      free(view_pos[i]);
+    }
+    free(records);
+    free(keys);
+    free(keys_tmp);
+  }
+
+  thread_scaling_benchmark();
+}
+
+/* }}} */
 
 static void rotation_ticks(struct app_contents *app, float rotx, float roty) {
   app->anglex += rotx;
   app->angley += roty;
 }
 
-static void init_local_gl(void) {
-  /* no depth buffer */
-  glDisable(GL_DEPTH_TEST);
+/* animates and prepares the next frame of a screen */
+static void next_frame(struct app_contents *app)
+{
+  rotation_ticks(app, 0.02, 0.2);
+  gradient_toggle_step(app);
+  change_colors(app, 10000);
+  step_visibility(app, 30000);
+  prepare_frame(app);
+}
+
+/* {{{ frame worker */
+
+#ifdef HAVE_PTHREAD
+
+static void *frame_worker_main(void *arg)
+{
+  struct app_contents *app = (struct app_contents *) arg;
+  struct frame_worker *w = &(app->worker);
+
+  pthread_mutex_lock(&w->lock);
+  for (;;)
+  {
+    while (!w->busy && !w->quit)
+      pthread_cond_wait(&w->cond, &w->lock);
+    if (w->quit)
+      break;
+    pthread_mutex_unlock(&w->lock);
+
+    next_frame(app);
+
+    pthread_mutex_lock(&w->lock);
+    w->busy = False;
+    pthread_cond_broadcast(&w->cond);
+  }
+  pthread_mutex_unlock(&w->lock);
+  return NULL;
+}
+
+/* without a thread the frames are prepared synchronously */
+static void start_frame_worker(struct app_contents *app)
+{
+  struct frame_worker *w = &(app->worker);
+
+  if (w->running)
+    return;
+
+  pthread_mutex_init(&w->lock, NULL);
+  pthread_cond_init(&w->cond, NULL);
+  w->busy = False;
+  w->quit = False;
+
+  if (pthread_create(&w->thread, NULL, frame_worker_main, app) != 0) {
+    pthread_cond_destroy(&w->cond);
+    pthread_mutex_destroy(&w->lock);
+    return;
+  }
+  w->running = True;
+}
+
+static void stop_frame_worker(struct app_contents *app)
+{
+  struct frame_worker *w = &(app->worker);
+
+  if (!w->running)
+    return;
+
+  pthread_mutex_lock(&w->lock);
+  w->quit = True;
+  pthread_cond_broadcast(&w->cond);
+  pthread_mutex_unlock(&w->lock);
+
+  pthread_join(w->thread, NULL);
+  pthread_cond_destroy(&w->cond);
+  pthread_mutex_destroy(&w->lock);
+  w->running = False;
+}
+
+/* the scene of a screen must not be touched while its next frame
+   is being prepared */
+static void wait_frame_worker(struct app_contents *app)
+{
+  struct frame_worker *w = &(app->worker);
+
+  if (!w->running)
+    return;
+
+  pthread_mutex_lock(&w->lock);
+  while (w->busy)
+    pthread_cond_wait(&w->cond, &w->lock);
+  pthread_mutex_unlock(&w->lock);
+}
+
+static void queue_next_frame(struct app_contents *app)
+{
+  struct frame_worker *w = &(app->worker);
+
+  if (!w->running) {
+    next_frame(app);
+    return;
+  }
+
+  pthread_mutex_lock(&w->lock);
+  w->busy = True;
+  pthread_cond_broadcast(&w->cond);
+  pthread_mutex_unlock(&w->lock);
+}
+
+#else /* !HAVE_PTHREAD */
+
+static void start_frame_worker(struct app_contents *app) { }
+static void stop_frame_worker(struct app_contents *app) { }
+static void wait_frame_worker(struct app_contents *app) { }
+
+static void queue_next_frame(struct app_contents *app)
+{
+  next_frame(app);
+}
+
+#endif /* !HAVE_PTHREAD */
+
+/* }}} */
+
+static void init_local_gl(struct app_contents *app) {
+  init_item_meshes();
+  init_mesh_buffers(app);
+
+  init_outline_program(app);
+  app->single_pass = single_pass;
+  if (single_pass && app->outline_prog == 0)
+    fprintf(stderr, "%s: single pass outlines need OpenGL 2.0 shaders, "
+                    "drawing the items in three passes\n", progname);
+
+  init_fragment_query(app);
+
+  /* no depth buffer, but to compare with */
+  app->zbuffer = False;
+  if (zbuffer && app->soft)
+    fprintf(stderr, "%s: the software backend has no depth buffer\n",
+            progname);
+  else if (zbuffer) {
+    GLint bits = 0;
+    glGetIntegerv(GL_DEPTH_BITS, &bits);
+    if (bits > 0)
+      app->zbuffer = True;
+    else
+      fprintf(stderr, "%s: no depth buffer in this visual\n", progname);
+  }
+  if (app->zbuffer) {
+    glEnable(GL_DEPTH_TEST);
+    glDepthFunc(GL_LESS);
+  }
+  else
+    glDisable(GL_DEPTH_TEST);
   glShadeModel(GL_FLAT);
 
   /* assumes clean models */
@@ -699,6 +3671,200 @@ static void init_local_gl(void) {
   glCullFace(GL_FRONT);
 }
 
+/* {{{ frame benchmark */
+
+#define BENCH_SEED 1234
+#define BENCH_WARMUP 10
+
+enum bench_phase {
+  PHASE_ANIMATE, PHASE_MATRIX, PHASE_ORDER, PHASE_COLOR, PHASE_SUBMIT,
+  PHASE_SWAP, NB_PHASES
+};
+
+static const char *bench_phase_names[NB_PHASES] = {
+  "animate", "matrix", "order", "color", "submit", "swap"
+};
+
+/* -benchmark N draws N frames of each scene from the same random seed
+   and the same angles, then prints the time of each phase of a frame
+   and exits. Without a display, run it on Xvfb, with llvmpipe for a
+   machine independent GL:
+     LIBGL_ALWAYS_SOFTWARE=1 xvfb-run -s '-screen 0 800x800x24' \
+       unsorted -window -benchmark 500
+   the swap phase includes a glFinish(), so that the GL work
+   queued by the submission is counted in the frame. With -overdraw,
+   the fragments drawn per frame and the overdraw are printed too.
+   With -backend soft, the submit phase is the rasterization and the
+   swap phase the copy of the image to the window. */
+static void frame_benchmark(ModeInfo *mi, struct app_contents *app)
+{
+  static const enum geom_type types[] = { CUBE_GEOM, CYLINDER_GEOM };
+  int t;
+
+  printf("%s: %d frames of %dx%d, %d threads, %s%s\n", progname,
+         bench_frames, MI_WIDTH(mi), MI_HEIGHT(mi), pool_threads(),
+         (app->soft ? "software" :
+          use_outlines(app) ? "single pass" : "three passes"),
+         (app->zbuffer ? ", depth buffer" : ""));
+  printf("   scene     items");
+  for (t = 0; t < NB_PHASES; t++)
+    printf("  %7s", bench_phase_names[t]);
+  printf("    total      fps");
+  if (app->frag_query)
+    printf("   fragments  overdraw");
+  printf("\n");
+
+  for (t = 0; t < countof(types); t++)
+  {
+    double phase[NB_PHASES];
+    double total = 0.0, fragments = 0.0;
+    int f, p, n;
+
+    srandom(BENCH_SEED);
+    app->type = types[t];
+    app->anglex = 30.0;
+    app->angley = 60.0;
+    app->draw_mode = 0;
+    init_scene(app);
+    n = (app->type == CUBE_GEOM ? app->geom.cube_app.num_items
+                                 : app->geom.cylinder_app.num_items);
+    memset(phase, 0, sizeof(phase));
+
+    for (f = 0; f < BENCH_WARMUP + bench_frames; f++)
+    {
+      double tp[NB_PHASES + 1];
+
+      tp[0] = bench_gettime();
+      rotation_ticks(app, 0.02, 0.2);
+      gradient_toggle_step(app);
+      change_colors(app, 10000);
+      step_visibility(app, 30000);
+      tp[1] = bench_gettime();
+      prepare_view(app);
+      tp[2] = bench_gettime();
+      prepare_order(app);
+      tp[3] = bench_gettime();
+      prepare_colors(app);
+      app->frame_ready = True;
+      tp[4] = bench_gettime();
+      if (app->soft)
+        soft_display(app);
+      else {
+        begin_fragment_count(app);
+        main_display(app);
+        end_fragment_count(app);
+      }
+      tp[5] = bench_gettime();
+      if (app->soft)
+        soft_present(mi, &app->soft_fb);
+      else {
+        glFinish();
+        glXSwapBuffers(MI_DISPLAY(mi), MI_WINDOW(mi));
+      }
+      tp[6] = bench_gettime();
+
+      if (f >= BENCH_WARMUP) {
+        for (p = 0; p < NB_PHASES; p++)
+          phase[p] += tp[p + 1] - tp[p];
+        /* the frame is finished, this does not wait */
+        fragments += read_fragment_count(app);
+      }
+    }
+
+    printf("  %6s  %8d", (app->type == CUBE_GEOM ? "cubes" : "cyls"), n);
+    for (p = 0; p < NB_PHASES; p++) {
+      printf("  %7.3f", phase[p] / bench_frames * 1e3);
+      total += phase[p];
+    }
+    printf("  %7.3f  %7.1f", total / bench_frames * 1e3,
+           bench_frames / total);
+    if (app->frag_query)
+      printf("  %10.0f  %8.2f", fragments / bench_frames,
+             overdraw_of(app, fragments / bench_frames));
+    printf("\n");
+  }
+  printf("  (times in ms per frame)\n");
+}
+
+/* }}} */
+
+static void report_stats(struct app_contents *app)
+{
+  struct frame_stats *st = &app->stats;
+
+  if (++st->frames < STATS_FRAMES)
+    return;
+
+  fprintf(stderr, "%s: %s, sort: %.1f moves/frame (max %lu), "
+                  "%lu full sorts in %lu frames, "
+                  "%.1f cubes/frame occluded\n",
+          progname, (app->type == CUBE_GEOM ? "cubes" : "cylinders"),
+          (double) st->sort_moves / st->frames, st->sort_max_moves,
+          st->sort_full, st->frames,
+          (double) st->occluded / st->frames);
+  if (app->type == CYLINDER_GEOM && use_lod)
+  {
+    int l;
+    fprintf(stderr, "%s: cylinders/frame by segments:", progname);
+    for (l = 0; l < NB_CYLINDER_LODS; l++)
+      fprintf(stderr, " %d: %.1f", cylinder_lod_segments[l],
+              (double) st->lod_items[l] / st->frames);
+    fprintf(stderr, "\n");
+  }
+  if (app->frag_query)
+    fprintf(stderr, "%s: %.0f fragments/frame, overdraw %.2f\n",
+            progname, st->fragments / st->frames,
+            overdraw_of(app, st->fragments / st->frames));
+
+  memset(st, 0, sizeof(struct frame_stats));
+}
+
+#ifdef DEBUG
+/* draws the frame in three passes then in a single pass
+   and counts the pixels that differ */
+static void outline_parity_check(ModeInfo *mi, struct app_contents *app)
+{
+  int w = MI_WIDTH(mi), h = MI_HEIGHT(mi);
+  unsigned char *ref, *out;
+  Bool saved = app->single_pass;
+  long i, diff = 0;
+
+  if (app->outline_prog == 0) {
+    fprintf(stderr, "%s: no single pass outlines to check\n", progname);
+    return;
+  }
+
+  ref = malloc((size_t) w * h * 4);
+  out = malloc((size_t) w * h * 4);
+  if (ref == NULL || out == NULL) {
+    fprintf(stderr, "%s: out of memory\n", progname);
+    exit(1);
+  }
+
+  app->single_pass = False;
+  main_display(app);
+  glReadPixels(0, 0, w, h, GL_RGBA, GL_UNSIGNED_BYTE, ref);
+
+  app->single_pass = True;
+  main_display(app);
+  glReadPixels(0, 0, w, h, GL_RGBA, GL_UNSIGNED_BYTE, out);
+
+  app->single_pass = saved;
+
+  for (i = 0; i < (long) w * h; i++)
+    if (abs(ref[i*4+0] - out[i*4+0]) > 8 ||
+        abs(ref[i*4+1] - out[i*4+1]) > 8 ||
+        abs(ref[i*4+2] - out[i*4+2]) > 8)
+      diff++;
+
+  fprintf(stderr, "%s: single pass differs on %ld of %d pixels (%.2f%%)\n",
+          progname, diff, w * h, 100.0 * diff / ((double) w * h));
+
+  free(ref);
+  free(out);
+}
+#endif /* DEBUG */
+
 static GLXContext *
 get_glxcontext_of_screen(int screen)
 {
@@ -716,7 +3882,17 @@ ENTRYPOINT void init_unsorted(ModeInfo *mi)
   display = MI_DISPLAY(mi);
   window = MI_WINDOW(mi);
 
+  if (sort_bench) {
+    sort_benchmark();
+    exit(0);
+  }
+
+  /* when the screen is reinitialized */
+  if (app_storage != NULL)
+    stop_frame_worker(&app_storage[MI_SCREEN(mi)]);
+
   init_app(mi, &app_storage);
+  start_thread_pool(num_threads);
 
   glx_context = get_glxcontext_of_screen( MI_SCREEN(mi) );
 
@@ -726,8 +3902,15 @@ ENTRYPOINT void init_unsorted(ModeInfo *mi)
     return;
   }
 
-  init_local_gl();
+  init_local_gl(&app_storage[MI_SCREEN(mi)]);
   reshape_unsorted(mi, MI_WIDTH(mi), MI_HEIGHT(mi));
+
+  if (bench_frames > 0) {
+    frame_benchmark(mi, &app_storage[MI_SCREEN(mi)]);
+    exit(0);
+  }
+
+  start_frame_worker(&app_storage[MI_SCREEN(mi)]);
 }
 
 ENTRYPOINT void draw_unsorted(ModeInfo *mi)
@@ -735,13 +3918,13 @@ ENTRYPOINT void draw_unsorted(ModeInfo *mi)
   GLXContext *glx_context;
   Display *display;
   Window window;
-  int screen;
+  struct app_contents *app;
 
   display = MI_DISPLAY(mi);
   window = MI_WINDOW(mi);
-  screen = MI_SCREEN(mi);
+  app = &app_storage[MI_SCREEN(mi)];
 
-  glx_context = app_storage[screen].glx_context;
+  glx_context = app->glx_context;
 
   MI_IS_DRAWN(mi) = True;
 
@@ -750,22 +3933,48 @@ ENTRYPOINT void draw_unsorted(ModeInfo *mi)
 
   glXMakeCurrent(display, window, *glx_context);
 
-  if (screen != 0) {
-    glClearColor(0.0, 0.0, 0.0, 0.0);
-    glClear(GL_COLOR_BUFFER_BIT);
+  /* every screen draws its own scene, its frame has been
+     prepared by its worker since the last call */
+  wait_frame_worker(app);
+#ifdef DEBUG
+  if (app->parity_check) {
+    outline_parity_check(mi, app);
+    app->parity_check = False;
+  }
+#endif
+  if (app->soft) {
+    soft_display(app);
+    if (show_stats)
+      report_stats(app);
+    app->frame_ready = False;
+    queue_next_frame(app);
+
+    /* no swap, it would show the GL back buffer over the image */
+    soft_present(mi, &app->soft_fb);
+    if (mi->fps_p && mi->fpst)
+      soft_draw_fps(mi, &app->soft_fb,
+                    fps_compute(mi->fpst, mi->polygon_count,
+                                mi->recursion_depth));
     return;
+  }
 
-  } else {
-    /* display */
-    main_display(app_storage[screen]);
+  begin_fragment_count(app);
+  main_display(app);
+  end_fragment_count(app);
 
-    /* animate */
-    rotation_ticks(&app_storage[screen], 0.02, 0.2);
-    gradient_toggle_step(&app_storage[screen]);
-    change_colors(&app_storage[screen], 10000);
-    step_visibility(&app_storage[screen], 30000);
+  if (app->frag_query) {
+    unsigned long fragments = read_fragment_count(app);
+    app->stats.fragments += fragments;
+    mi->recursion_depth = overdraw_of(app, fragments);
   }
 
+  if (show_stats)
+    report_stats(app);
+
+  /* animate, the worker runs while the other screens draw */
+  app->frame_ready = False;
+  queue_next_frame(app);
+
   if (mi->fps_p) do_fps (mi);
   glFinish();
   glXSwapBuffers(display, window);
@@ -773,10 +3982,24 @@ ENTRYPOINT void draw_unsorted(ModeInfo *mi)
 
 ENTRYPOINT void reshape_unsorted(ModeInfo *mi, int width, int height)
 {
+  struct app_contents *app = &app_storage[MI_SCREEN(mi)];
+
+  /* the field of view is 60 degrees along the height */
+  app->pixel_angle = 2.0 * tan(VIEW_FOVY / 2.0 * M_PI / 180.0) /
+                    (height > 0 ? height : 1);
+  app->pixels = (unsigned long) width * height;
+
+  if (app->soft && !resize_soft_target(mi, &app->soft_fb, width, height)) {
+    fprintf(stderr, "%s: the software backend needs a 32 bit true color "
+                    "visual, using gl\n", progname);
+    release_soft_target(MI_DISPLAY(mi), &app->soft_fb);
+    app->soft = False;
+  }
+
   glViewport(0, 0, (GLint) width, (GLint) height);
   glMatrixMode(GL_PROJECTION);
   glLoadIdentity();
-  gluPerspective(60.0, 1.0, 0.5, 100.0);
+  gluPerspective(VIEW_FOVY, 1.0, 0.5, 100.0);
   glMatrixMode(GL_MODELVIEW);
 }
 
@@ -799,22 +4022,31 @@ static Bool keyboard(struct app_contents * app, char key) {
       rotation_ticks(app, 0.06, 0.6);
       return True;
 
+    case 's':
+      app->single_pass = !app->single_pass;
+      return True;
+
+#ifdef DEBUG
+    case 'd':
+      app->parity_check = True;
+      return True;
+#endif
+
+    case 'o':
+      switch (app->order) {
+        case ORDER_AUTO: app->order = ORDER_SORT; break;
+        case ORDER_SORT: app->order = ORDER_LATTICE; break;
+        case ORDER_LATTICE: app->order = ORDER_BSP; break;
+        case ORDER_BSP: app->order = ORDER_AUTO; break;
+      }
+      return True;
+
     case ' ':
       switch (app->type) {
         case CUBE_GEOM: app->type = CYLINDER_GEOM; break;
         case CYLINDER_GEOM: app->type = CUBE_GEOM; break;
       }
-      if (app->type == CUBE_GEOM)
-      {
-        init_cubes_color(app);
-        init_cubes_visibility(app);
-      }
-      if (app->type == CYLINDER_GEOM)
-      {
-        init_cylinders_color(app);
-        init_cylinder_visibility(app);
-        init_cylinder_circ_cache(app);
-      }
+      init_scene(app);
       return True;
 
     default:
@@ -824,16 +4056,20 @@ static Bool keyboard(struct app_contents * app, char key) {
 
 ENTRYPOINT Bool unsorted_handle_event(ModeInfo *mi, XEvent *event)
 {
-  int screen;
-  screen = MI_SCREEN(mi);
-  if (screen != 0) return False;
+  struct app_contents *app = &app_storage[MI_SCREEN(mi)];
 
   if(event->xany.type == KeyPress)
   {
     char key;
     key = XKeycodeToKeysym(mi->dpy, event->xkey.keycode, 0);
 
-    return keyboard(&app_storage[screen], key);
+    wait_frame_worker(app);
+    if (!keyboard(app, key))
+      return False;
+
+    /* the prepared frame is out of date */
+    app->frame_ready = False;
+    return True;
   }
   return False;
 }
@@ -845,9 +4081,17 @@ ENTRYPOINT void refresh_unsorted(ModeInfo *mi)
 ENTRYPOINT void release_unsorted(ModeInfo *mi)
 {
   if (app_storage) {
+    int screen;
+    for (screen = 0; screen < MI_NUM_SCREENS(mi); screen++) {
+      stop_frame_worker(&app_storage[screen]);
+      release_soft_target(MI_DISPLAY(mi), &(app_storage[screen].soft_fb));
+      free_arena(&(app_storage[screen].arena));
+      free(app_storage[screen].radix);
+    }
     free(app_storage);
     app_storage = NULL;
   }
+  stop_thread_pool();
   FreeAllGL(mi);
 }
 